@@ -25,6 +25,8 @@
 #ifndef ASYNCC_H
 #define ASYNCC_H
 
+#include <stddef.h>
+
 #define ASYNCC_VERSION_MAJOR    0
 #define ASYNCC_VERSION_MINOR    0
 #define ASYNCC_VERSION_PATCH    1
@@ -38,11 +40,11 @@
 #define FE_3(ACTION, X, ...) ACTION(X)FE_2(ACTION, __VA_ARGS__)
 #define FE_4(ACTION, X, ...) ACTION(X)FE_3(ACTION, __VA_ARGS__)
 #define FE_5(ACTION, X, ...) ACTION(X)FE_4(ACTION, __VA_ARGS__)
-#define FE_6(ACTION, X, ...) ACTION(X)FE_4(ACTION, __VA_ARGS__)
-#define FE_7(ACTION, X, ...) ACTION(X)FE_4(ACTION, __VA_ARGS__)
-#define FE_8(ACTION, X, ...) ACTION(X)FE_4(ACTION, __VA_ARGS__)
-#define FE_9(ACTION, X, ...) ACTION(X)FE_4(ACTION, __VA_ARGS__)
-#define FE_10(ACTION, X, ...) ACTION(X)FE_4(ACTION, __VA_ARGS__)
+#define FE_6(ACTION, X, ...) ACTION(X)FE_5(ACTION, __VA_ARGS__)
+#define FE_7(ACTION, X, ...) ACTION(X)FE_6(ACTION, __VA_ARGS__)
+#define FE_8(ACTION, X, ...) ACTION(X)FE_7(ACTION, __VA_ARGS__)
+#define FE_9(ACTION, X, ...) ACTION(X)FE_8(ACTION, __VA_ARGS__)
+#define FE_10(ACTION, X, ...) ACTION(X)FE_9(ACTION, __VA_ARGS__)
 
 #define GET_MACRO(_0,_1,_2,_3,_4,_5,_6,_7,_8,_9,_10,NAME,...) NAME 
 #define FOR_EACH(ACTION,...) \
@@ -52,6 +54,12 @@
 #define L_DEFINE(X)     X;
 #define L_DEFINES(...) FOR_EACH(L_DEFINE,__VA_ARGS__)
 
+#if defined(__GNUC__) || defined(__clang__)
+#define ASYNC_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define ASYNC_UNLIKELY(x) (x)
+#endif
+
 enum async {
     ASYNC_INIT,
     ASYNC_CONT = ASYNC_INIT,
@@ -66,62 +74,504 @@ enum async {
 
 #ifdef LIVE_DANGEROUSLY
 
+#ifdef ASYNC_TRACK_EXTENT
+#error "ASYNC_TRACK_EXTENT needs the stack length, so it can't LIVE_DANGEROUSLY"
+#endif
+
+// Stack header is just the index
+#define ASYNC_HDR_SIZE  2
+
 // Init stack index and initial spot within function (no len, live dangerously)
 #define async_init(s, len)              \
-        *((uint16_t*)s+0) = 2;          \
-        *((uint16_t*)s+1) = ASYNC_INIT
+        *((uint16_t*)s+0) = ASYNC_HDR_SIZE; \
+        SPOT(s) = ASYNC_INIT
 
-#define ASYNC_BEGIN(s, ...)                                         \
-    uint16_t *s_idx = (uint16_t*)(s);                               \
-    struct locals { L_DEFINES(uint16_t spot, __VA_ARGS__) } *l;     \
-    l = (struct locals*)(s + *s_idx);                               \
-    *s_idx += sizeof(struct locals);                                \
-    switch (l->spot) { default:
+// No bounds checking, the frame is just used
+#define a_check(s, size)
+#define a_fits(n)       1
+#define a_room(n)       1
+#define a_check_extra()
+
+#else
 
+// Stack header is the index and max length, plus the extent of the frames
+// that were live at the last suspension when ASYNC_TRACK_EXTENT is defined
+// (needed to shrink or hibernate a stack, see asyncc_reloc.h)
+#ifdef ASYNC_TRACK_EXTENT
+#define ASYNC_HDR_SIZE  6
+#define A_INIT_EXT(s)   *((uint16_t*)s+2) = ASYNC_HDR_SIZE;
 #else
+#define ASYNC_HDR_SIZE  4
+#define A_INIT_EXT(s)
+#endif
 
 // Init stack index, max length, and initial spot within function
 #define async_init(s, len)              \
-        *((uint16_t*)s+0) = 4;          \
+        *((uint16_t*)s+0) = ASYNC_HDR_SIZE; \
         *((uint16_t*)s+1) = len;        \
-        *((uint16_t*)s+2) = ASYNC_INIT
+        A_INIT_EXT(s)                   \
+        SPOT(s) = ASYNC_INIT
+
+// Called when a frame doesn't fit on its stack (define it in your application)
+void async_err(uint8_t *s, uint16_t size);
 
+// Bail out (safely) if the frame doesn't fit, otherwise continue into the
+// block that follows.  Nothing has been pushed yet, so there is nothing to pop.
+#define a_check(s, size)                                            \
+    if ((*s_idx + (size)) > s_idx[1]) {                             \
+        async_err(s, size);                                         \
+        a_count(ASYNC_M_OVERFLOWS);                                 \
+        return ASYNC_ERR;                                           \
+    } else
+
+// Same check for async_alloca(), which reports the overflow and carries on
+#define a_fits(n)                                                   \
+    (a_room(n) ||                                                   \
+        (async_err((uint8_t*)s_idx, n), a_count(ASYNC_M_OVERFLOWS), 0))
+#define a_room(n)       (*s_idx + (n) <= s_idx[1])
+
+// A resumed async_alloca_begin() frame pushes the size it grew by, which must
+// still fit (only a corrupted frame could have grown past the end)
+#define a_check_extra()                                             \
+    if (!a_room(a_frame + a_extra)) {                               \
+        async_err(s, a_frame + a_extra);                            \
+        a_count(ASYNC_M_OVERFLOWS);                                 \
+        return ASYNC_ERR;                                           \
+    }
+
+#endif
+
+// Each function knows how many bytes it pushes onto the stack (a_frame), and
+// how many it uses above the index without pushing them (a_leaf, only for the
+// async_inline_begin() functions below)
 #define async_begin(s, ...)                                         \
     uint16_t *s_idx = (uint16_t*)(s);                               \
-    uint16_t *s_max = (uint16_t*)(s)+1;                             \
-    struct locals { L_DEFINES(uint16_t spot, __VA_ARGS__) } *l;     \
-    if ((*s_idx + sizeof(struct locals)) > *s_max) {                \
-        async_err(s, sizeof(struct locals));                        \
-        a_pop();                                                    \
-        return ASYNC_ERR;                                           \
-    } else {                                                        \
+    struct locals { L_DEFINES(uint16_t spot A_TRACE_FIELDS, __VA_ARGS__) } *l;     \
+    enum { a_frame = sizeof(struct locals), a_leaf = 0,             \
+        a_spot_base = A_SPOT_BASE };                                \
+    uint16_t a_extra = 0;                                           \
+    ASYNC_HOT(A_HOT_DECL)                                           \
+    a_trace_decl()                                                  \
+    a_check(s, sizeof(struct locals)) {                             \
         l = (struct locals*)(s + *s_idx);                           \
+        a_extent_reset();                                           \
+        a_trace();                                                  \
         a_push();                                                   \
         switch (l->spot) { default:
 
+// Leaf functions (ones that never call another async function on the same
+// stack) can skip the push and pop of a frame entirely.  Their locals sit just
+// above the caller's frame, exactly where a pushed frame would have gone, and
+// nothing else uses that memory until the leaf is done.  Declared static
+// inline, a leaf like "wait for a register bit and read it" compiles down to
+// the bounds check, the spot dispatch, and the condition itself.
+//
+//   static inline enum async read_reg(uint8_t *s, uint8_t *out)
+//   {
+//       async_inline_begin(s);
+//       await(REG_STATUS & REG_READY);
+//       *out = REG_DATA;
+//       async_inline_end(s);
+//   }
+//
+// The spot is reset when a leaf finishes, so it can be awaited again from the
+// same place right away.
+#define async_inline_begin(s, ...)                                  \
+    uint16_t *s_idx = (uint16_t*)(s);                               \
+    struct locals { L_DEFINES(uint16_t spot A_TRACE_FIELDS, __VA_ARGS__) } *l;     \
+    enum { a_frame = 0, a_leaf = sizeof(struct locals),             \
+        a_spot_base = A_SPOT_BASE };                                \
+    uint16_t a_extra = 0;                                           \
+    ASYNC_HOT(A_HOT_DECL)                                           \
+    a_trace_decl()                                                  \
+    a_check(s, sizeof(struct locals)) {                             \
+        l = (struct locals*)(s + *s_idx);                           \
+        a_extent_reset();                                           \
+        a_trace();                                                  \
+        switch (l->spot) { default:
+
+#define async_inline_end(s)                                         \
+    if (l->spot != ASYNC_INIT) l->spot = ASYNC_INIT;                \
+    a_end()
+
+// Runtime-sized scratch memory: functions that start with async_alloca_begin()
+// can grow their own frame with async_alloca(), a pointer bump on the task's
+// stack.  The frame records how much it grew (a_extra), so the memory stays
+// put across suspensions and is released when the frame is popped for good.
+//
+//   enum async handle(uint8_t *s, uint16_t len)
+//   {
+//       async_alloca_begin(s, uint8_t *buf);
+//       async_alloca(l->buf, len);
+//       if (!l->buf) {
+//           async_exit;         // Didn't fit (async_err() was called)
+//       }
+//       await_call(read_into(s, l->buf, len));
+//       ...
+//   }
+//
+// Everything called after an allocation sits above it, so allocate before
+// awaiting other functions when you can.  n is rounded up to a multiple of
+// ASYNC_ALLOCA_ALIGN, so the frames above it keep the alignment they would
+// have had (the memory itself has the alignment of the stack index).  It
+// lives inside the stack, so a stack that holds a pointer to it can't be
+// moved (see asyncc_reloc.h).  Leaves can't allocate.
+#ifndef ASYNC_ALLOCA_ALIGN
+#define ASYNC_ALLOCA_ALIGN  _Alignof(max_align_t)
+#endif
+#define ASYNC_ALLOCA_SIZE(n)                                        \
+    (((n) + ASYNC_ALLOCA_ALIGN - 1) & ~(ASYNC_ALLOCA_ALIGN - 1))
+
+#define async_alloca_begin(s, ...)                                  \
+    uint16_t *s_idx = (uint16_t*)(s);                               \
+    struct locals { L_DEFINES(uint16_t spot A_TRACE_FIELDS, uint16_t a_extra, __VA_ARGS__) } *l; \
+    enum { a_frame = sizeof(struct locals), a_leaf = 0,             \
+        a_spot_base = A_SPOT_BASE };                                \
+    uint16_t a_extra = 0;                                           \
+    ASYNC_HOT(A_HOT_DECL)                                           \
+    a_trace_decl()                                                  \
+    a_check(s, sizeof(struct locals)) {                             \
+        l = (struct locals*)(s + *s_idx);                           \
+        if (l->spot == ASYNC_INIT) l->a_extra = 0;                  \
+        a_extra = l->a_extra;                                       \
+        a_check_extra();                                            \
+        a_extent_reset();                                           \
+        a_trace();                                                  \
+        a_push();                                                   \
+        switch (l->spot) { default:
+
+// Point p at n more bytes on top of the frame (NULL if they don't fit)
+#define async_alloca(p, n)                                          \
+    if (!a_fits(ASYNC_ALLOCA_SIZE(n))) { (p) = NULL; } else {       \
+        (p) = (void*)((uint8_t*)s_idx + *s_idx);                    \
+        *s_idx += ASYNC_ALLOCA_SIZE(n);                             \
+        a_extra = l->a_extra += ASYNC_ALLOCA_SIZE(n);               \
+        a_trace();                                                  \
+    }
+
+// Hot locals: every access to a local goes through l->, and since the
+// compiler has to assume that memory may alias anything else, values get
+// reloaded after every call and stored after every change.  Locals named in
+// ASYNC_HOT are copied into real C variables when the function is resumed,
+// and only written back when it suspends, so tight loops can run out of
+// registers:
+//
+//   #undef ASYNC_HOT
+//   #define ASYNC_HOT(X) X(i) X(sum)
+//   enum async checksum(uint8_t *s, uint8_t *buf, uint16_t len)
+//   {
+//       async_begin(s, uint16_t i, uint16_t sum);
+//       for (i = 0, sum = 0; i < len; i++) {
+//           sum += buf[i];
+//           if ((i & 0xFF) == 0xFF) {
+//               async_yield;
+//           }
+//       }
+//       ...
+//   }
+//   #undef ASYNC_HOT
+//   #define ASYNC_HOT(X)
+//
+// Use the plain names in the function body (l->i is only up to date at the
+// suspension points).  Only scalar locals can be hot, and this needs
+// __typeof__ (GCC or clang).
+#define ASYNC_HOT(X)
+#define A_HOT_DECL(v)   __typeof__(l->v) v;
+#define A_HOT_LOAD(v)   v = l->v;
+#define A_HOT_SAVE(v)   l->v = v;
+#define a_load()        ASYNC_HOT(A_HOT_LOAD)
+#define a_save()        ASYNC_HOT(A_HOT_SAVE)
+
+// The first suspension point to unwind is the innermost one, so the largest
+// index seen while popping suspended frames is the live extent of the stack.
+// It is reset every time the top-level function is resumed.
+#ifdef ASYNC_TRACK_EXTENT
+#define a_extent_reset() if (*s_idx == ASYNC_HDR_SIZE) s_idx[2] = ASYNC_HDR_SIZE
+#define a_extent()                                                  \
+    if (*s_idx + a_leaf > s_idx[2]) s_idx[2] = *s_idx + a_leaf
+#else
+#define a_extent_reset()
+#define a_extent()
 #endif
 
-#define a_push() *s_idx+=sizeof(struct locals)
-#define a_pop()  *s_idx-=sizeof(struct locals)
+#define a_push() *s_idx+=a_frame+a_extra
+#define a_pop()  *s_idx-=a_frame+a_extra
 
-#define async_end(s) case ASYNC_DONE: a_pop(); return ASYNC_DONE; } }
+// A finished function leaves ASYNC_DONE in its frame, so awaiting it again
+// (e.g. the finished side of a fork-join) just returns ASYNC_DONE
+#define async_end(s) l->spot = ASYNC_DONE; a_end()
+#define a_end() case ASYNC_DONE: a_pop(); return ASYNC_DONE; } }
 
-#define async_done(s) *((uint16_t*)s+2) = ASYNC_DONE
+#define async_done(s) SPOT(s) = ASYNC_DONE
 
-#define await_while(cond) l->spot = __LINE__; case __LINE__:if (cond) { a_pop(); return ASYNC_CONT; }
+// Resume points are numbered by source line by default, which keeps them easy
+// to debug but makes the spot switch sparse (compilers tend to turn it into a
+// compare chain), lets two awaits on one line collide, and runs out of 16 bits
+// past line 65535.  Define ASYNC_DENSE_SPOTS to number them 3, 4, 5, ... within
+// each function instead (from __COUNTER__, relative to a base taken in
+// async_begin), so resuming is a single indexed jump.
+//
+// Dense spots are recorded in an "asyncc_spots" linker section (GCC or clang
+// on ELF), see async_spot_line() to map them back to source lines.  Define
+// ASYNC_NO_SPOT_TABLE to leave the table out.
+#ifdef ASYNC_DENSE_SPOTS
+#define A_SPOT_BASE     __COUNTER__
+#define A_SPOT          __COUNTER__
+#define a_spot(n)       ((n) - a_spot_base + ASYNC_DONE)
+#else
+#define A_SPOT_BASE     0
+#define A_SPOT          __LINE__
+#define a_spot(n)       (n)
+#endif
+
+#if defined(ASYNC_DENSE_SPOTS) && !defined(ASYNC_NO_SPOT_TABLE)
+// Table entries are padded to a power of two and aligned to it, so the
+// entries from every object file pack into an array
+struct __attribute__((aligned(4 * sizeof(void*)))) async_spot {
+    const char *func;
+    const char *file;
+    uint16_t line;
+    uint16_t spot;
+};
+
+#define a_spot_info(n)                                              \
+    { static const struct async_spot a_info                         \
+        __attribute__((used, section("asyncc_spots"))) =            \
+        { __func__, __FILE__, __LINE__, a_spot(n) }; }
+
+extern const struct async_spot __start_asyncc_spots[] __attribute__((weak));
+extern const struct async_spot __stop_asyncc_spots[] __attribute__((weak));
+
+// Source line of a resume point in func (0 if unknown)
+static inline uint16_t async_spot_line(const char *func, uint16_t spot)
+{
+    for (const struct async_spot *i = __start_asyncc_spots; i < __stop_asyncc_spots; i++) {
+        if (i->spot == spot && __builtin_strcmp(i->func, func) == 0) {
+            return i->line;
+        }
+    }
+    return 0;
+}
+#else
+#define a_spot_info(n)
+#endif
+
+// Logical stack traces: define ASYNC_TRACE and every frame also records which
+// function it belongs to and its size, so the chain of awaiting functions can
+// be read straight off the stack with async_backtrace() (see asyncc_prof.h
+// for a sampling profiler built on it).  That costs 4 bytes and two stores per
+// frame.  Functions are described in an "asyncc_funcs" linker section (GCC or
+// clang on ELF), and a frame's function id is its index there.
+#ifdef ASYNC_TRACE
+struct __attribute__((aligned(4 * sizeof(void*)))) async_func {
+    const char *name;
+    const char *file;
+    uint32_t line;
+};
+
+extern const struct async_func __start_asyncc_funcs[] __attribute__((weak));
+extern const struct async_func __stop_asyncc_funcs[] __attribute__((weak));
+
+#define A_TRACE_FIELDS  ; uint16_t a_fid; uint16_t a_size
+#define a_trace_decl()                                              \
+    static const struct async_func a_func                           \
+        __attribute__((used, section("asyncc_funcs"))) =            \
+        { __func__, __FILE__, __LINE__ };
+#define a_trace()                                                   \
+    l->a_fid = (uint16_t)(&a_func - __start_asyncc_funcs);          \
+    l->a_size = a_frame + a_leaf + a_extra
+
+struct async_frame {
+    const struct async_func *func;
+    uint16_t spot;          // Last suspension point (stale while running)
+};
+
+// Fill out[] with up to max frames of stack s, outermost first, and return
+// how many there were.  A running task (in a signal handler or debugger) is
+// walked up to IDX, which leaves out a leaf that is running right now.  A
+// suspended task has nothing pushed, so it can only be walked with
+// ASYNC_TRACK_EXTENT.
+static inline uint16_t async_backtrace(uint8_t *s, struct async_frame *out, uint16_t max)
+{
+    uint16_t *idx = (uint16_t*)s;
+    uint16_t top = *idx;
+#ifdef ASYNC_TRACK_EXTENT
+    if (top == ASYNC_HDR_SIZE) {
+        top = idx[2];
+    }
+#endif
+    uint16_t n = 0, nfuncs = (uint16_t)(__stop_asyncc_funcs - __start_asyncc_funcs);
+    for (uint16_t at = ASYNC_HDR_SIZE; at + 6 <= top && n < max; n++) {
+        uint16_t f[3];
+        __builtin_memcpy(f, s + at, sizeof(f));
+        if (f[1] >= nfuncs || f[2] < 6) {
+            break;
+        }
+        out[n].func = &__start_asyncc_funcs[f[1]];
+        out[n].spot = f[0];
+        at += f[2];
+    }
+    return n;
+}
+#else
+#define A_TRACE_FIELDS
+#define a_trace_decl()
+#define a_trace()
+#endif
+
+// Define ASYNC_METRICS to have each runtime count what its tasks do (see
+// asyncc_metrics.h).  The counters the core bumps itself go to the runtime
+// that is resuming a task on this thread (none outside of a runtime).
+#ifdef ASYNC_METRICS
+enum async_metric {
+    ASYNC_M_RESUMES,
+    ASYNC_M_YIELDS,         // Resumes that left the task ready
+    ASYNC_M_PARKS,          // Resumes that left the task parked
+    ASYNC_M_WAKES,          // Parked tasks handed back to the ready queue
+    ASYNC_M_PUSHES,         // Tasks added to the ready queue
+    ASYNC_M_READY,          // Ready queue depth (PUSHES - RESUMES, only
+                            // filled in by async_metrics_read())
+    ASYNC_M_READY_MAX,      // Deepest the ready queue has been
+    ASYNC_M_TIMERS_ARMED,
+    ASYNC_M_TIMERS_FIRED,
+    ASYNC_M_CHAN_FULL,      // Channel waits for room
+    ASYNC_M_CHAN_EMPTY,     // Channel waits for a message
+    ASYNC_M_POOL_FULL,      // await_for_each_n() suspensions with items left
+                            // over for lack of a free slot
+    ASYNC_M_OVERFLOWS,      // Frames that didn't fit (calls to async_err())
+    ASYNC_M_COUNT
+};
+
+// Counters of the runtime being resumed on this thread
+__thread uint64_t *async_metrics_cur __attribute__((weak));
+
+// Counters have a single writer (the runtime's thread), so they are bumped
+// without a locked instruction, but with a store that other threads can read
+// untorn
+static inline void async_metric_add(uint64_t *m, enum async_metric id, uint64_t n)
+{
+    if (m) {
+        __atomic_store_n(&m[id], m[id] + n, __ATOMIC_RELAXED);
+    }
+}
+
+#define a_count(id)     async_metric_add(async_metrics_cur, id, 1)
+#else
+#define a_count(id)     ((void)0)
+#endif
+
+// Most awaits are already satisfied when first reached, so the condition is
+// checked before anything is stored: the spot is only written when we really
+// suspend.  Resuming jumps into the dead if (0) block and re-checks from there.
+#define await_while(cond) a_await_while(cond, A_SPOT)
+#define a_await_while(cond, n)                                      \
+    a_spot_info(n)                                                  \
+    if (0) { case a_spot(n): a_load(); }                            \
+    if (ASYNC_UNLIKELY(cond)) {                                     \
+        a_save();                                                   \
+        l->spot = a_spot(n); a_extent(); a_pop(); return ASYNC_CONT; \
+    }
 #define await(cond) await_while(!(cond))
 
+// Awaiting async functions called on our own stack:
+//
+//   await_call(parse(s, l->buf));
+//   await_call(step(s) & step(l->sub));     // Fork-join
+//
+// Reaching it (not resuming it) starts a new call, so the frame above ours is
+// marked ASYNC_INIT before the condition runs: whatever finished or gave up
+// there before (a sibling, or the same function awaited in a loop) left its
+// own spot, which would otherwise be resumed.  Plain await() touches no
+// memory when its condition already holds, so use it for everything else
+// (leaves reset their own spot, so they don't need this either).  With
+// LIVE_DANGEROUSLY there is no length to check, so stacks need 2 bytes of
+// room above the deepest frame that calls.
+#define await_call(cond) a_fresh(); await(cond)
+#define a_fresh()                                                   \
+    if (!a_leaf && a_room(2)) {                                     \
+        *(uint16_t*)((uint8_t*)s_idx + *s_idx) = ASYNC_INIT;        \
+    }
+
 
-#define async_yield l->spot = __LINE__; a_pop(); return ASYNC_CONT; case __LINE__:
+#define async_yield a_yield(A_SPOT)
+#define a_yield(n)                                                  \
+    a_spot_info(n)                                                  \
+    a_save(); l->spot = a_spot(n); a_extent(); a_pop(); return ASYNC_CONT; \
+    case a_spot(n): a_load()
 #define async_exit l->spot = ASYNC_DONE; a_pop(); return ASYNC_DONE
 
+// Bounded parallel map: run fn(sub-stack, &items[i]) for every item, with at
+// most n in flight, each on its own sub-stack from a pool.  A slot is refilled
+// with the next item as soon as its child finishes, and the await completes
+// once every item is done.
+//
+//   enum async flush(uint8_t *s, struct record *recs, uint16_t count)
+//   {
+//       async_begin(s, ASYNC_POOL(pool, 8, 64));    // 8 sub-stacks of 64 bytes
+//       await_for_each_n(recs, count, write_record, 8, l->pool);
+//       if (l->pool.failed) {
+//           ...                 // Children that returned ASYNC_ERR
+//       }
+//       async_end(s);
+//   }
+//
+// The pool can also live outside the frame (a static ASYNC_POOL()), it is
+// only used until the await completes.  Every resume polls the children that
+// are in flight; under asyncc_rt.h the task parks whenever they all park (see
+// the note there about fork-join).  items and count are evaluated again on
+// every resume, so keep them in locals or globals.
+#define ASYNC_POOL_FREE 0xFFFF
+#define ASYNC_POOL(name, n, len)                                    \
+    struct {                                                        \
+        uint16_t next;          /* Next item to start */            \
+        uint16_t left;          /* Items not finished */            \
+        uint16_t failed;        /* Items that returned ASYNC_ERR */ \
+        uint16_t item[n];       /* Item per slot, or ASYNC_POOL_FREE */ \
+        uint8_t s[n][len];                                          \
+    } name
+
+#define await_for_each_n(items, count, fn, n, pool)                 \
+    a_for_each_n(items, count, fn, n, pool, A_SPOT)
+#define a_for_each_n(items, count, fn, n, pool, sp)                 \
+    (pool).next = 0;                                                \
+    (pool).left = (count);                                          \
+    (pool).failed = 0;                                              \
+    for (uint16_t a_k = 0; a_k < (n); a_k++) {                      \
+        (pool).item[a_k] = ASYNC_POOL_FREE;                         \
+    }                                                               \
+    a_spot_info(sp)                                                 \
+    if (0) { case a_spot(sp): a_load(); }                           \
+    for (uint16_t a_k = 0; a_k < (n); a_k++) {                      \
+        while ((pool).item[a_k] != ASYNC_POOL_FREE || (pool).next < (count)) { \
+            if ((pool).item[a_k] == ASYNC_POOL_FREE) {              \
+                (pool).item[a_k] = (pool).next++;                   \
+                async_init((pool).s[a_k], sizeof((pool).s[a_k]));   \
+            }                                                       \
+            enum async a_r = fn((pool).s[a_k], &(items)[(pool).item[a_k]]); \
+            if (a_r == ASYNC_CONT) {                                \
+                break;                                              \
+            }                                                       \
+            (pool).failed += a_r == ASYNC_ERR;                      \
+            (pool).item[a_k] = ASYNC_POOL_FREE;                     \
+            (pool).left--;                                          \
+        }                                                           \
+    }                                                               \
+    if ((pool).left) {                                              \
+        if ((pool).next < (count)) {                                \
+            a_count(ASYNC_M_POOL_FULL);                             \
+        }                                                           \
+        a_save();                                                   \
+        l->spot = a_spot(sp); a_extent(); a_pop(); return ASYNC_CONT; \
+    }
+
 // For those who don't like dereferencing struct members so much:
 #define _(v) l->v
 
-// Helpers to get stack index, max len, and current spot
+// Helpers to get stack index, max len, live extent, and current spot
 #define IDX(s)  *((uint16_t*)s+0)
 #define MAX(s)  *((uint16_t*)s+1)
-#define SPOT(s) *((uint16_t*)s+2)
+#define EXT(s)  *((uint16_t*)s+2)
+#define SPOT(s) *((uint16_t*)((uint8_t*)s+ASYNC_HDR_SIZE))
 
 // Gets the 8-bit stack value for printing
 #define SVAL(s,idx) *((uint8_t*)s+idx)
@@ -0,0 +1,250 @@
+// @file asyncc_fiber.h
+// Stackful fiber tasks, for code that has to suspend deep inside its own calls
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+#ifndef ASYNCC_FIBER_H
+#define ASYNCC_FIBER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "asyncc_rt.h"
+
+// Some code can't be turned into async functions, typically a library that
+// suspends (or wants to) from a callback deep inside its own call stack.  A
+// fiber runs such code on a stack of its own, as a task of an ordinary
+// runtime:
+//
+//   static struct async_fiber parser;
+//   static uint8_t parser_stack[16384] __attribute__((aligned(16)));
+//
+//   static int read_cb(void *buf, int len)          // Called by the library
+//   {
+//       struct async_fiber *f = async_fiber_self();
+//       async_fiber_await(f, async_topic_wait(f->s, &rx, &last));
+//       return copy_out(&rx, &last, buf, len);
+//   }
+//
+//   static void parser_main(struct async_fiber *f, void *arg)
+//   {
+//       legacy_parse(read_cb, arg);                 // Never returns early
+//   }
+//
+//   async_fiber_sched(&rt, &task, &parser, parser_main, NULL,
+//           parser_stack, sizeof(parser_stack));
+//
+// async_fiber_await(f, cond) suspends the fiber until cond holds, checking it
+// every time the task is resumed, exactly like await().  While the fiber runs
+// it is the runtime's current task, so anything that parks the current task
+// (async_park_on(), the await_*() helpers' slow paths) parks the fiber, and
+// async functions can be awaited on f->s, a small asyncc stack of its own:
+//
+//   async_fiber_await(f, async_sleep(f->s, &ib, 10));
+//
+// The switch saves only the callee-saved registers (x86-64 and AArch64
+// Linux), so the cost is a few nanoseconds, but every fiber needs a real
+// stack, sized for the deepest call it makes (there is no guard page).  Code
+// in a fiber must not change the floating point control state.
+
+#ifndef ASYNC_FIBER_S
+#define ASYNC_FIBER_S   128         // Bytes of f->s
+#endif
+
+struct async_fiber {
+    void *sp;                       // Saved stack pointer of the fiber
+    void *back;                     // ... and of the runtime while it runs
+    void (*fn)(struct async_fiber *f, void *arg);
+    void *arg;
+    uint8_t done;
+    uint8_t s[ASYNC_FIBER_S];       // Stack for the async functions it awaits
+};
+
+// Save the callee-saved registers on the current stack, store the stack
+// pointer in *from, and resume the context saved at to
+void async_fiber_switch(void **from, void *to);
+
+// Fiber being run on this thread (NULL outside of fibers)
+__thread struct async_fiber *async_fiber_now __attribute__((weak));
+
+static inline struct async_fiber *async_fiber_self(void)
+{
+    return async_fiber_now;
+}
+
+// First thing a new fiber runs (called from async_fiber_start)
+__attribute__((weak, used, noreturn)) void async_fiber_main(struct async_fiber *f)
+{
+    f->fn(f, f->arg);
+    f->done = 1;
+    for (;;) {
+        async_fiber_switch(&f->sp, f->back);
+    }
+}
+
+#if defined(__x86_64__)
+// The new stack holds the six registers and then async_fiber_start as the
+// return address, with the fiber in r12
+#define ASYNC_FIBER_FRAME   7
+#define ASYNC_FIBER_ARG     3
+#define ASYNC_FIBER_RET     6
+__asm__(
+    ".pushsection .text\n"
+    ".weak async_fiber_switch\n"
+    ".type async_fiber_switch, @function\n"
+    "async_fiber_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size async_fiber_switch, .-async_fiber_switch\n"
+    ".weak async_fiber_start\n"
+    ".type async_fiber_start, @function\n"
+    "async_fiber_start:\n"
+    "    movq %r12, %rdi\n"
+    "    call async_fiber_main@PLT\n"
+    "    ud2\n"
+    ".size async_fiber_start, .-async_fiber_start\n"
+    ".popsection\n");
+#elif defined(__aarch64__)
+// x19-x30 and d8-d15 (22 slots, 176 bytes), with the fiber in x19 and
+// async_fiber_start in x30 on a new stack
+#define ASYNC_FIBER_FRAME   22
+#define ASYNC_FIBER_ARG     0
+#define ASYNC_FIBER_RET     11
+__asm__(
+    ".pushsection .text\n"
+    ".weak async_fiber_switch\n"
+    ".type async_fiber_switch, %function\n"
+    "async_fiber_switch:\n"
+    "    sub sp, sp, #176\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x2, sp\n"
+    "    str x2, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #176\n"
+    "    ret\n"
+    ".size async_fiber_switch, .-async_fiber_switch\n"
+    ".weak async_fiber_start\n"
+    ".type async_fiber_start, %function\n"
+    "async_fiber_start:\n"
+    "    mov x0, x19\n"
+    "    bl async_fiber_main\n"
+    "    brk #0\n"
+    ".size async_fiber_start, .-async_fiber_start\n"
+    ".popsection\n");
+#else
+#error "asyncc_fiber.h supports x86-64 and AArch64 only"
+#endif
+
+void async_fiber_start(void);
+
+// Set up f to run fn(f, arg) on stack (len bytes)
+static inline void async_fiber_init(struct async_fiber *f,
+        void (*fn)(struct async_fiber *f, void *arg), void *arg,
+        uint8_t *stack, size_t len)
+{
+    // The first switch pops the initial registers and "returns" into
+    // async_fiber_start, leaving the stack pointer at the aligned top
+    uintptr_t top = ((uintptr_t)stack + len) & ~(uintptr_t)15;
+    void **sp = (void**)top - ASYNC_FIBER_FRAME;
+    for (int i = 0; i < ASYNC_FIBER_FRAME; i++) {
+        sp[i] = NULL;
+    }
+    sp[ASYNC_FIBER_ARG] = f;
+    sp[ASYNC_FIBER_RET] = (void*)async_fiber_start;
+    f->sp = sp;
+    f->back = NULL;
+    f->fn = fn;
+    f->arg = arg;
+    f->done = 0;
+    async_init(f->s, ASYNC_FIBER_S);
+}
+
+// Give control back to the runtime until the task is resumed
+static inline void async_fiber_suspend(struct async_fiber *f)
+{
+    async_fiber_switch(&f->sp, f->back);
+}
+
+// Suspend until cond holds.  A child awaited on f->s starts fresh each time.
+#define async_fiber_await(f, cond)                                  \
+    do {                                                            \
+        SPOT((f)->s) = ASYNC_INIT;                                  \
+        while (!(cond)) {                                           \
+            async_fiber_suspend(f);                                 \
+        }                                                           \
+    } while (0)
+
+// Let the other tasks run once
+#define async_fiber_yield(f)    async_fiber_suspend(f)
+
+// The task function that runs a fiber (its stack argument is unused)
+static inline enum async async_fiber_task(uint8_t *s, void *arg)
+{
+    struct async_fiber *f = arg;
+    struct async_fiber *outer = async_fiber_now;
+    (void)s;
+    async_fiber_now = f;
+    async_fiber_switch(&f->back, f->sp);
+    async_fiber_now = outer;
+    return f->done ? ASYNC_DONE : ASYNC_CONT;
+}
+
+static inline void async_fiber_sched(struct async_runtime *rt, struct async_task *t,
+        struct async_fiber *f, void (*fn)(struct async_fiber *f, void *arg), void *arg,
+        uint8_t *stack, size_t len)
+{
+    async_fiber_init(f, fn, arg, stack, len);
+    async_sched(rt, t, async_fiber_task, f, f->s, ASYNC_FIBER_S);
+}
+
+#endif // ASYNCC_FIBER_H
@@ -0,0 +1,276 @@
+// @file asyncc_hibernate.h
+// Hibernate idle tasks to (memory-mapped) storage and restore them later
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+#ifndef ASYNCC_HIBERNATE_H
+#define ASYNCC_HIBERNATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "asyncc_reloc.h"
+
+// A suspended asyncc stack is its whole continuation (the SPOT of every frame
+// plus the locals), so it can be written out as a flat image and read back
+// into any buffer later.  The same rules as relocation apply: stacks that hold
+// pointers into themselves can't be saved.  Define ASYNC_TRACK_EXTENT so only
+// the live frames are written.
+//
+// SPOT values are line numbers in the code that wrote the image, so an image
+// is only good for the exact same build, and images from other builds are
+// rejected as stale.  Nothing inside one translation unit can tell whether
+// the ones holding the task functions were rebuilt, so the build has to say:
+// define ASYNC_BUILD_ID to a 32-bit value that is the same for the whole
+// program and changes whenever any of it does (a hash of the sources or
+// objects, or a build counter), e.g.
+//
+//   cc -DASYNC_BUILD_ID=$(cat src/*.[ch] | cksum | cut -d' ' -f1)u ...
+//
+// The options that change the frame layout (ASYNC_TRACE, ASYNC_DENSE_SPOTS,
+// and the stack header size) are also recorded in every image.  A checksum
+// over the header and frames catches torn or corrupted images, and a
+// restored image is invalidated so it can't be resumed twice.
+
+#define ASYNC_IMAGE_MAGIC   0x43595341u     // "ASYC"
+#define ASYNC_IMAGE_VERSION 2
+
+#ifndef ASYNC_BUILD_ID
+#error "asyncc_hibernate.h needs ASYNC_BUILD_ID (the same for the whole program)"
+#endif
+
+enum async_image {
+    ASYNC_IMAGE_OK,
+    ASYNC_IMAGE_NOSPACE,    // Sink too small, or restore buffer too short
+    ASYNC_IMAGE_PINNED,     // Stack can't be moved (see asyncc_reloc.h)
+    ASYNC_IMAGE_STALE,      // Written by another build or asyncc version
+    ASYNC_IMAGE_CORRUPT,    // Bad magic or checksum (or already restored)
+};
+
+struct async_image_hdr {
+    uint32_t magic;
+    uint32_t sum;           // FNV-1a over this header (sum = 0) and the frames
+    uint32_t build;         // ASYNC_BUILD_ID
+    uint16_t version;       // ASYNC_IMAGE_VERSION
+    uint16_t abi;           // asyncc version and frame layout options
+    uint16_t len;           // MAX of the saved stack
+    uint16_t used;          // Bytes of stack following the header
+};
+
+#ifdef ASYNC_TRACE
+#define A_IMAGE_TRACE       1
+#else
+#define A_IMAGE_TRACE       0
+#endif
+#ifdef ASYNC_DENSE_SPOTS
+#define A_IMAGE_DENSE       1
+#else
+#define A_IMAGE_DENSE       0
+#endif
+
+// Version in the top 12 bits, then the header size (2, 4, or 6 bytes) and
+// the options that add frame fields or renumber the spots
+#define ASYNC_IMAGE_ABI \
+    ((ASYNCC_VERSION_MAJOR << 12) | (ASYNCC_VERSION_MINOR << 8) | \
+     (ASYNCC_VERSION_PATCH << 4) | (A_IMAGE_DENSE << 3) | \
+     (A_IMAGE_TRACE << 2) | (ASYNC_HDR_SIZE / 2))
+
+static inline uint32_t async_fnv1a(uint32_t h, const uint8_t *p, size_t n)
+{
+    while (n--) {
+        h = (h ^ *p++) * 16777619u;
+    }
+    return h;
+}
+
+static inline uint32_t async_image_sum(struct async_image_hdr *h, const uint8_t *frames)
+{
+    uint32_t sum = h->sum;
+    h->sum = 0;
+    uint32_t v = async_fnv1a(2166136261u, (const uint8_t*)h, sizeof(*h));
+    h->sum = sum;
+    return async_fnv1a(v, frames, h->used);
+}
+
+// Write the image of suspended stack s to sink (sink_len bytes)
+static inline enum async_image async_park_to(uint8_t *sink, size_t sink_len, uint8_t *s)
+{
+    struct async_image_hdr h;
+    h.used = async_stack_used(s);
+    if (sink_len < sizeof(h) + h.used) {
+        return ASYNC_IMAGE_NOSPACE;
+    }
+    if (async_stack_pinned(s)) {
+        return ASYNC_IMAGE_PINNED;
+    }
+    h.magic = ASYNC_IMAGE_MAGIC;
+    h.sum = 0;
+    h.build = ASYNC_BUILD_ID;
+    h.version = ASYNC_IMAGE_VERSION;
+    h.abi = ASYNC_IMAGE_ABI;
+    h.len = MAX(s);
+    h.sum = async_image_sum(&h, s);
+
+    memcpy(sink + sizeof(h), s, h.used);
+    memcpy(sink, &h, sizeof(h));
+    return ASYNC_IMAGE_OK;
+}
+
+// Restore an image from src (src_len bytes) into dst (len bytes, or the
+// original length if len is 0).  The image is invalidated on success.
+static inline enum async_image async_restore_from(uint8_t *dst, uint16_t len,
+        uint8_t *src, size_t src_len)
+{
+    struct async_image_hdr h;
+    if (src_len < sizeof(h)) {
+        return ASYNC_IMAGE_CORRUPT;
+    }
+    memcpy(&h, src, sizeof(h));
+    if (h.magic != ASYNC_IMAGE_MAGIC) {
+        return ASYNC_IMAGE_CORRUPT;
+    }
+    if (h.version != ASYNC_IMAGE_VERSION || h.abi != ASYNC_IMAGE_ABI ||
+            h.build != ASYNC_BUILD_ID) {
+        return ASYNC_IMAGE_STALE;
+    }
+    // The header is checked before the checksum reads the frames it describes
+    if (h.used < ASYNC_HDR_SIZE || h.used > h.len ||
+            sizeof(h) + h.used > src_len) {
+        return ASYNC_IMAGE_CORRUPT;
+    }
+    if (!len) {
+        len = h.len;
+    }
+    if (len < h.used) {
+        return ASYNC_IMAGE_NOSPACE;
+    }
+    if (h.sum != async_image_sum(&h, src + sizeof(h))) {
+        return ASYNC_IMAGE_CORRUPT;
+    }
+
+    memcpy(dst, src + sizeof(h), h.used);
+    MAX(dst) = len;
+    h.magic = 0;
+    memcpy(src, &h, sizeof(h.magic));
+    return ASYNC_IMAGE_OK;
+}
+
+// A backing file split into fixed-size slots, one image per slot.  The file is
+// mapped shared, so evicted slots cost page cache at most (and nothing once
+// the kernel writes them back and reclaims them).
+struct async_store {
+    uint8_t *map;
+    size_t slot_len;
+    uint32_t slots;
+    int fd;
+};
+
+static inline int async_store_open(struct async_store *st, const char *path,
+        uint32_t slots, size_t slot_len)
+{
+    st->slot_len = slot_len;
+    st->slots = slots;
+    st->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (st->fd < 0) {
+        return -1;
+    }
+    if (ftruncate(st->fd, (off_t)(slots * slot_len)) < 0) {
+        close(st->fd);
+        return -1;
+    }
+    st->map = mmap(NULL, slots * slot_len, PROT_READ | PROT_WRITE, MAP_SHARED, st->fd, 0);
+    if (st->map == MAP_FAILED) {
+        close(st->fd);
+        return -1;
+    }
+    return 0;
+}
+
+static inline void async_store_close(struct async_store *st)
+{
+    munmap(st->map, st->slots * st->slot_len);
+    close(st->fd);
+}
+
+static inline uint8_t *async_store_slot(struct async_store *st, uint32_t slot)
+{
+    return st->map + slot * st->slot_len;
+}
+
+// Drop the resident pages of n slots starting at slot.  Only whole pages are
+// dropped, so use page-sized slots, or evict neighbouring slots in batches.
+static inline void async_store_evict(struct async_store *st, uint32_t slot, uint32_t n)
+{
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t lo = ((uintptr_t)async_store_slot(st, slot) + page - 1) & ~(page - 1);
+    uintptr_t hi = (uintptr_t)async_store_slot(st, slot + n) & ~(page - 1);
+    if (lo >= hi) {
+        return;
+    }
+#ifdef MADV_PAGEOUT
+    if (madvise((void*)lo, hi - lo, MADV_PAGEOUT) == 0) {
+        return;
+    }
+#endif
+    madvise((void*)lo, hi - lo, MADV_DONTNEED);
+}
+
+// Hibernate a parked task into a store slot.  On success the task is marked
+// cold and its stack buffer can be reused right away.
+static inline enum async_image async_task_hibernate(struct async_store *st,
+        uint32_t slot, struct async_task *t)
+{
+    if (t->state != ASYNC_TASK_PARKED) {
+        return ASYNC_IMAGE_PINNED;
+    }
+    enum async_image r = async_park_to(async_store_slot(st, slot), st->slot_len, t->s);
+    if (r == ASYNC_IMAGE_OK) {
+        t->state = ASYNC_TASK_COLD;
+        t->s = NULL;
+        async_store_evict(st, slot, 1);
+    }
+    return r;
+}
+
+// Restore a cold task into stack s (len bytes, 0 for the original length) and
+// make it ready.  It re-checks whatever it was waiting for, so wakeups that
+// were ignored while it was cold are not lost.
+static inline enum async_image async_task_thaw(struct async_runtime *rt,
+        struct async_store *st, uint32_t slot, struct async_task *t,
+        uint8_t *s, uint16_t len)
+{
+    if (t->state != ASYNC_TASK_COLD) {
+        return ASYNC_IMAGE_STALE;
+    }
+    enum async_image r = async_restore_from(s, len, async_store_slot(st, slot),
+            st->slot_len);
+    if (r == ASYNC_IMAGE_OK) {
+        t->s = s;
+        async_rt_push(rt, t);
+    }
+    return r;
+}
+
+#endif // ASYNCC_HIBERNATE_H
@@ -0,0 +1,270 @@
+// @file asyncc_log.h
+// Append-only log with group commit: one writev and fdatasync per batch
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+#ifndef ASYNCC_LOG_H
+#define ASYNCC_LOG_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include "asyncc_net.h"
+
+// Tasks that need a record on disk before they go on append it and park:
+//
+//   enum async handler(uint8_t *s, void *arg)
+//   {
+//       async_begin(s, struct async_log_rec rec, char buf[64]);
+//       l->rec.data = l->buf;
+//       l->rec.len = format_record(l->buf);
+//       await_log_append(&log, l->rec);
+//       if (l->rec.res < 0) {
+//           ...                     // -errno of the write or fdatasync
+//       }
+//       async_end(s);
+//   }
+//
+// One writer task, async_log_task(), takes every record appended since the
+// last batch and hands them to a helper thread, which writes them with one
+// writev() (more if there are over ASYNC_LOG_IOV) and one fdatasync().  The
+// writer waits for the helper on an eventfd in the epoll reactor, so the
+// runtime keeps running tasks meanwhile, then wakes the whole batch.  Records
+// appended during a sync make up the next batch, so the more tasks append at
+// once, the more records each sync covers.
+//
+// The record must stay put until the await is over (keep it and its data in
+// the locals, or in static memory).  Records hit the file in the order they
+// were appended.
+
+#ifndef ASYNC_LOG_IOV
+#define ASYNC_LOG_IOV       64      // Records per writev()
+#endif
+
+#define ASYNC_LOG_PENDING   1       // Value of res until the record is synced
+
+struct async_log_rec {
+    struct async_log_rec *next;
+    struct async_task *task;
+    const void *data;
+    uint32_t len;
+    int res;                // 0 once durable, or -errno
+};
+
+struct async_log {
+    struct async_net *net;
+    struct async_task *writer;
+    struct async_log_rec *head;     // Appended since the last batch
+    struct async_log_rec *tail;
+    struct async_log_rec *batch;    // Being written by the helper (it and
+    int res;                        // res are handed over by the eventfds)
+    int fd;
+    int go_fd;                      // Eventfd: writer -> helper
+    int done_fd;                    // Eventfd: helper -> writer
+    uint8_t stop;
+    pthread_t helper;
+    uint64_t batches;               // Syncs so far, and the records they
+    uint64_t records;               // covered
+};
+
+// Write every record of the list r (in order), returns 0 or -errno
+static inline int async_log_write(int fd, struct async_log_rec *r)
+{
+    struct iovec iov[ASYNC_LOG_IOV];
+    uint32_t off = 0;               // Bytes of r that are already written
+    while (r) {
+        struct async_log_rec *q = r->next;
+        int n = 1;
+        iov[0].iov_base = (uint8_t*)r->data + off;
+        iov[0].iov_len = r->len - off;
+        for (; q && n < ASYNC_LOG_IOV; q = q->next, n++) {
+            iov[n].iov_base = (void*)q->data;
+            iov[n].iov_len = q->len;
+        }
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        while (r && (size_t)w >= r->len - off) {
+            w -= r->len - off;
+            off = 0;
+            r = r->next;
+        }
+        off += (uint32_t)w;
+    }
+    return 0;
+}
+
+static inline void *async_log_helper(void *arg)
+{
+    struct async_log *log = arg;
+    uint64_t v;
+    for (;;) {
+        if (read(log->go_fd, &v, sizeof(v)) != sizeof(v)) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (!log->batch) {
+            break;
+        }
+        log->res = async_log_write(log->fd, log->batch);
+        if (!log->res && fdatasync(log->fd) < 0) {
+            log->res = -errno;
+        }
+        v = 1;
+        if (write(log->done_fd, &v, sizeof(v)) < 0) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Open (or create) the log file at path for appending and start its helper
+// thread, returns 0 or -1.  Schedule async_log_task() with the log as arg on
+// net's runtime.
+static inline int async_log_open(struct async_log *log, struct async_net *net,
+        const char *path)
+{
+    log->net = net;
+    log->writer = NULL;
+    log->head = NULL;
+    log->tail = NULL;
+    log->batch = NULL;
+    log->stop = 0;
+    log->batches = 0;
+    log->records = 0;
+    log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    log->go_fd = eventfd(0, EFD_CLOEXEC);
+    log->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (log->fd < 0 || log->go_fd < 0 || log->done_fd < 0 ||
+            pthread_create(&log->helper, NULL, async_log_helper, log) != 0) {
+        close(log->fd);
+        close(log->go_fd);
+        close(log->done_fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Have the writer finish the records already appended and then exit
+static inline void async_log_stop(struct async_log *log)
+{
+    log->stop = 1;
+    if (log->writer) {
+        async_wake(log->net->rt, log->writer);
+    }
+}
+
+// Once the writer has exited: stop the helper and close the log
+static inline void async_log_close(struct async_log *log)
+{
+    uint64_t v = 1;
+    log->batch = NULL;
+    if (write(log->go_fd, &v, sizeof(v)) == sizeof(v)) {
+        pthread_join(log->helper, NULL);
+    }
+    close(log->fd);
+    close(log->go_fd);
+    close(log->done_fd);
+}
+
+static inline void async_log_submit(struct async_log *log, struct async_log_rec *r)
+{
+    r->next = NULL;
+    r->task = log->net->rt->current;
+    r->res = ASYNC_LOG_PENDING;
+    if (log->tail) {
+        log->tail->next = r;
+    } else {
+        log->head = r;
+    }
+    log->tail = r;
+    if (log->writer) {
+        async_wake(log->net->rt, log->writer);
+    }
+}
+
+// Append rec (a struct async_log_rec with data and len set) and wait until it
+// is durable, then rec.res is 0, or -errno if the batch failed
+#define await_log_append(log, rec)                                  \
+    async_log_submit(log, &(rec));                                  \
+    await((rec).res != ASYNC_LOG_PENDING ||                         \
+            !async_park_on((log)->net->rt, "log"))
+
+// The writer task (one per log)
+static inline enum async async_log_task(uint8_t *s, void *arg)
+{
+    struct async_log *log = arg;
+    struct async_runtime *rt = log->net->rt;
+    async_begin(s, uint64_t v, long n);
+    log->writer = rt->current;
+
+    for (;;) {
+        await(log->head || log->stop || !async_park_on(rt, "idle"));
+        if (!log->head) {
+            break;
+        }
+
+        // Everything appended so far goes in one batch
+        log->batch = log->head;
+        log->head = NULL;
+        log->tail = NULL;
+        l->v = 1;
+        if (write(log->go_fd, &l->v, sizeof(l->v)) < 0) {
+            log->res = -errno;
+        } else {
+            await_io(log->net, log->done_fd, EPOLLIN,
+                    async_net_done(l->n = read(log->done_fd, &l->v, sizeof(l->v))));
+            while (l->n < 0) {
+                // epoll refused the fd: block until the helper is done, it
+                // may still be reading the records
+                struct pollfd p = { log->done_fd, POLLIN, 0 };
+                poll(&p, 1, -1);
+                l->n = read(log->done_fd, &l->v, sizeof(l->v));
+            }
+        }
+
+        log->batches++;
+        for (struct async_log_rec *r = log->batch, *next; r; r = next) {
+            next = r->next;
+            r->res = log->res;
+            async_wake(rt, r->task);
+            log->records++;
+        }
+        log->batch = NULL;
+    }
+
+    log->writer = NULL;
+    async_end(s);
+}
+
+#endif // ASYNCC_LOG_H
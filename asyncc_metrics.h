@@ -0,0 +1,253 @@
+// @file asyncc_metrics.h
+// Runtime counters, aggregated over shards and exported for Prometheus
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+#ifndef ASYNCC_METRICS_H
+#define ASYNCC_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "asyncc_rt.h"
+
+#ifndef ASYNC_METRICS
+#error "asyncc_metrics.h needs ASYNC_METRICS (define it before including asyncc.h)"
+#endif
+
+// With ASYNC_METRICS defined every runtime (one shard per thread) counts its
+// resumes, yields, parks and wakes, the ready queue depth, timers, channel
+// waits, pool exhaustion, and stack overflows (see enum async_metric).  Each
+// shard only writes its own counters, so counting costs a plain add, and the
+// counters sit on cache lines of their own.  Reading them sums over every
+// shard that was registered:
+//
+//   static struct async_metrics reg;
+//   async_metrics_add(&reg, &rt0);      // At startup, before the threads
+//   async_metrics_add(&reg, &rt1);
+//
+//   uint64_t m[ASYNC_M_COUNT];
+//   async_metrics_read(&reg, m);        // From any thread
+//
+// async_metrics_text() formats the same numbers in the Prometheus text
+// format.  Include asyncc_net.h first to also get async_metrics_task(),
+// which answers every HTTP request on a listening socket with them.  It
+// serves one client at a time and drops any client that takes longer than
+// ASYNC_METRICS_TIMEOUT ms to send its request and read the answer, which
+// needs a timer service (asyncc_timer.h).
+
+#ifndef ASYNC_METRICS_SHARDS
+#define ASYNC_METRICS_SHARDS    16
+#endif
+
+#define ASYNC_METRICS_TEXT      3072    // Enough for the whole listing
+#define ASYNC_METRICS_STACK     (ASYNC_METRICS_TEXT + 128)
+
+#ifndef ASYNC_METRICS_TIMEOUT
+#define ASYNC_METRICS_TIMEOUT   2000    // ms a client may take
+#endif
+
+struct async_metrics {
+    struct async_runtime *shard[ASYNC_METRICS_SHARDS];
+    uint16_t shards;
+};
+
+static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+} async_metric_info[ASYNC_M_COUNT] = {
+    [ASYNC_M_RESUMES]       = {"asyncc_resumes_total", "counter", "Tasks resumed"},
+    [ASYNC_M_YIELDS]        = {"asyncc_yields_total", "counter", "Resumes that left the task ready"},
+    [ASYNC_M_PARKS]         = {"asyncc_parks_total", "counter", "Resumes that left the task parked"},
+    [ASYNC_M_WAKES]         = {"asyncc_wakes_total", "counter", "Parked tasks made ready again"},
+    [ASYNC_M_PUSHES]        = {"asyncc_pushes_total", "counter", "Tasks added to a ready queue"},
+    [ASYNC_M_READY]         = {"asyncc_ready_tasks", "gauge", "Tasks in the ready queues"},
+    [ASYNC_M_READY_MAX]     = {"asyncc_ready_tasks_max", "gauge", "Deepest ready queue of any shard"},
+    [ASYNC_M_TIMERS_ARMED]  = {"asyncc_timers_armed_total", "counter", "Timers armed"},
+    [ASYNC_M_TIMERS_FIRED]  = {"asyncc_timers_fired_total", "counter", "Timers fired"},
+    [ASYNC_M_CHAN_FULL]     = {"asyncc_chan_full_waits_total", "counter", "Waits for room in a channel"},
+    [ASYNC_M_CHAN_EMPTY]    = {"asyncc_chan_empty_waits_total", "counter", "Waits for a channel message"},
+    [ASYNC_M_POOL_FULL]     = {"asyncc_pool_full_total", "counter", "Pool awaits suspended with items waiting for a slot"},
+    [ASYNC_M_OVERFLOWS]     = {"asyncc_stack_overflows_total", "counter", "Frames that did not fit their stack"},
+};
+
+// Register a runtime, returns -1 if the registry is full
+static inline int async_metrics_add(struct async_metrics *reg, struct async_runtime *rt)
+{
+    if (reg->shards == ASYNC_METRICS_SHARDS) {
+        return -1;
+    }
+    reg->shard[reg->shards++] = rt;
+    return 0;
+}
+
+// Sum the counters of every shard into out (the max for READY_MAX).  Each
+// counter is read untorn, but the set is not one snapshot.
+static inline void async_metrics_read(struct async_metrics *reg, uint64_t *out)
+{
+    for (uint16_t i = 0; i < ASYNC_M_COUNT; i++) {
+        out[i] = 0;
+    }
+    for (uint16_t s = 0; s < reg->shards; s++) {
+        uint64_t *m = reg->shard[s]->m;
+        for (uint16_t i = 0; i < ASYNC_M_COUNT; i++) {
+            uint64_t v = __atomic_load_n(&m[i], __ATOMIC_RELAXED);
+            if (i == ASYNC_M_READY) {
+                // Two relaxed counters, so this can be off by the tasks
+                // pushed or resumed in between, and is clamped at 0
+                uint64_t popped = __atomic_load_n(&m[ASYNC_M_RESUMES], __ATOMIC_RELAXED);
+                v = __atomic_load_n(&m[ASYNC_M_PUSHES], __ATOMIC_RELAXED) - popped;
+                out[i] += (int64_t)v > 0 ? v : 0;
+            } else if (i == ASYNC_M_READY_MAX) {
+                out[i] = v > out[i] ? v : out[i];
+            } else {
+                out[i] += v;
+            }
+        }
+    }
+}
+
+// Format the counters for Prometheus into buf, returns the length (cut short
+// if buf is smaller than ASYNC_METRICS_TEXT)
+static inline size_t async_metrics_text(struct async_metrics *reg, char *buf, size_t len)
+{
+    uint64_t m[ASYNC_M_COUNT];
+    async_metrics_read(reg, m);
+    size_t n = 0;
+    for (uint16_t i = 0; i < ASYNC_M_COUNT && n < len; i++) {
+        n += snprintf(buf + n, len - n, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n",
+                async_metric_info[i].name, async_metric_info[i].help,
+                async_metric_info[i].name, async_metric_info[i].type,
+                async_metric_info[i].name, (unsigned long long)m[i]);
+    }
+    return n < len ? n : len - 1;
+}
+
+#ifdef ASYNCC_NET_H
+#include <netinet/in.h>
+#include "asyncc_timer.h"
+
+#define ASYNC_METRICS_HTTP \
+    "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n" \
+    "Connection: close\r\n\r\n"
+
+struct async_metrics_http {
+    struct async_net *net;
+    struct async_metrics *reg;
+    struct async_inbox *ib; // Timer inbox of the runtime the task runs on
+    int fd;                 // Listening socket, see async_metrics_listen()
+};
+
+// Listening TCP socket on ip (host byte order) and port, or -1.  The
+// counters say a lot about the process, so use INADDR_LOOPBACK unless the
+// scraper is on another host, and INADDR_ANY only on a trusted network.
+static inline int async_metrics_listen(in_addr_t ip, uint16_t port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(ip);
+
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+            bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// True once connection conn has had its time.  A timer can't be cancelled,
+// so the task keeps one armed while it serves, and re-arms it for whichever
+// connection is current when it fires: a client gets between one and two
+// timeouts.
+static inline int async_metrics_late(struct async_metrics_http *h,
+        struct async_timer *t, uint32_t *armed_for, uint32_t conn)
+{
+    if (!t->fired) {
+        return 0;
+    }
+    if (*armed_for == conn) {
+        return 1;
+    }
+    *armed_for = conn;
+    async_timer_arm(h->ib, t, ASYNC_METRICS_TIMEOUT, 0);
+    return 0;
+}
+
+// Answer each HTTP request (whatever its path) with the counters of every
+// shard, one client at a time.  Schedule it with a struct async_metrics_http
+// as arg and a stack of ASYNC_METRICS_STACK bytes, on the runtime that drains
+// h->ib.
+static inline enum async async_metrics_task(uint8_t *s, void *arg)
+{
+    struct async_metrics_http *h = arg;
+    async_begin(s, int conn, long n, uint32_t conns, uint32_t armed_for,
+            uint16_t len, uint16_t sent, struct async_timer timer,
+            char buf[ASYNC_METRICS_TEXT]);
+
+    l->conns = 0;
+    l->timer.fired = 1;     // Not armed
+    for (;;) {
+        await_accept(h->net, h->fd, l->conn);
+        if (l->conn < 0) {
+            async_yield;
+            continue;
+        }
+        l->conns++;
+        if (l->timer.fired) {
+            l->armed_for = l->conns;
+            async_timer_arm(h->ib, &l->timer, ASYNC_METRICS_TIMEOUT, 0);
+        }
+
+        // Only the start of the request is read, it is answered the same way.
+        // A client that runs out of time is closed (l->n is left at -1).
+        await_io(h->net, l->conn, EPOLLIN,
+                async_net_done(l->n = recv(l->conn, l->buf, sizeof(l->buf), 0)) ||
+                async_metrics_late(h, &l->timer, &l->armed_for, l->conns));
+        if (l->n > 0) {
+            l->len = (uint16_t)strlen(ASYNC_METRICS_HTTP);
+            memcpy(l->buf, ASYNC_METRICS_HTTP, l->len);
+            l->len += async_metrics_text(h->reg, l->buf + l->len, sizeof(l->buf) - l->len);
+            for (l->sent = 0; l->sent < l->len; l->sent += l->n) {
+                await_io(h->net, l->conn, EPOLLOUT,
+                        async_net_done(l->n = send(l->conn, l->buf + l->sent,
+                                l->len - l->sent, MSG_NOSIGNAL)) ||
+                        async_metrics_late(h, &l->timer, &l->armed_for, l->conns));
+                if (l->n < 0) {
+                    break;
+                }
+            }
+        }
+        close(l->conn);
+    }
+
+    async_end(s);
+}
+#endif
+
+#endif // ASYNCC_METRICS_H
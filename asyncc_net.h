@@ -0,0 +1,239 @@
+// @file asyncc_net.h
+// Async TCP/UDP sockets for the Linux host runtime (epoll reactor)
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+#ifndef ASYNCC_NET_H
+#define ASYNCC_NET_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "asyncc_rt.h"
+
+// Every socket operation is first tried non-blocking.  Only when the kernel
+// says EAGAIN does the task register a one-shot epoll interest for the fd and
+// park, so a socket that is already readable costs exactly one syscall.
+//
+// The fd must be non-blocking (sockets from await_accept() already are, see
+// async_net_nonblock() for the rest), and only one task may wait on a given fd
+// at a time.  The macro arguments are evaluated again every time the task is
+// resumed, so buffers and lengths should live in the locals (l->buf).
+//
+// The result lands in res exactly like the underlying syscall (-1 and errno on
+// error).
+//
+// The epoll interest points at the waiting task, and stays registered after
+// the wait (disabled once it fired).  If the task finishes or gives up on an
+// await (e.g. the losing side of a fork-join) while the fd stays open, call
+// async_net_forget() first, or an event still pending can wake a task that is
+// gone.  close() only drops the interest once no other fd (a dup() or a
+// child process) refers to the socket.
+//
+// accept4() needs _GNU_SOURCE, so define it before your first system include
+// if this header is not the first thing you include.
+
+#ifndef ASYNC_NET_EVENTS
+#define ASYNC_NET_EVENTS 64     // Max events handled per epoll_wait()
+#endif
+
+// How an idle runtime waits for I/O (see async_net_idle()).  By default it
+// blocks in epoll_wait() right away.  For latency-critical loops on a core of
+// their own it can spin instead: poll without blocking up to spin times,
+// pausing the CPU between polls (1 pause at first, doubling up to pause_max),
+// and only block once nothing turned up.  spin = ASYNC_SPIN_FOREVER never
+// blocks.  Spinning burns the core, and on a core shared with the threads
+// that produce the I/O it only gets in their way.
+#define ASYNC_SPIN_FOREVER  UINT32_MAX
+
+struct async_net {
+    struct async_runtime *rt;
+    int epfd;
+    uint32_t spin;              // Empty polls before blocking
+    uint32_t pause_max;         // Most pauses between two polls
+    uint32_t spun;              // Idle waits that spinning ended
+    uint32_t blocked;           // Idle waits that blocked
+};
+
+static inline int async_net_init(struct async_net *net, struct async_runtime *rt)
+{
+    net->rt = rt;
+    net->epfd = epoll_create1(EPOLL_CLOEXEC);
+    net->spin = 0;
+    net->pause_max = 64;
+    net->spun = 0;
+    net->blocked = 0;
+    return net->epfd < 0 ? -1 : 0;
+}
+
+static inline void async_net_spin(struct async_net *net, uint32_t spin, uint32_t pause_max)
+{
+    net->spin = spin;
+    net->pause_max = pause_max ? pause_max : 1;
+}
+
+// Tell the CPU we are in a spin loop (saves power, and the pipeline flush
+// when the loop exits)
+static inline void async_cpu_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static inline void async_net_close(struct async_net *net)
+{
+    close(net->epfd);
+    net->epfd = -1;
+}
+
+static inline int async_net_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// True once a non-blocking syscall result is final (not EAGAIN/EINTR)
+static inline int async_net_done(long res)
+{
+    return res >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+// Arm a one-shot interest for the current task and park it.  Returns 1 when
+// parked (keep waiting), or 0 if epoll refused the fd (give up, errno is set).
+static inline int async_net_wait(struct async_net *net, int fd, uint32_t events)
+{
+    struct epoll_event ev;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = net->rt->current;
+    if (epoll_ctl(net->epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        if (errno != ENOENT || epoll_ctl(net->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            return 0;
+        }
+    }
+    return async_park_on(net->rt, "io");
+}
+
+// Drop fd's epoll interest and with it the pointer to the task that last
+// waited on it.  Returns 0 (also if there was none), or -1.
+static inline int async_net_forget(struct async_net *net, int fd)
+{
+    if (epoll_ctl(net->epfd, EPOLL_CTL_DEL, fd, NULL) < 0 && errno != ENOENT) {
+        return -1;
+    }
+    return 0;
+}
+
+// Wait up to timeout_ms (-1 forever) for I/O and wake the tasks that can make
+// progress.  Returns the number of events, or -1 on error.
+static inline int async_net_poll(struct async_net *net, int timeout_ms)
+{
+    struct epoll_event evs[ASYNC_NET_EVENTS];
+    int n = epoll_wait(net->epfd, evs, ASYNC_NET_EVENTS, timeout_ms);
+    for (int i = 0; i < n; i++) {
+        async_wake(net->rt, (struct async_task*)evs[i].data.ptr);
+    }
+    return n;
+}
+
+// Wait for I/O with nothing ready to run, spinning first if the policy says
+// so.  Returns like async_net_poll().
+static inline int async_net_idle(struct async_net *net)
+{
+    uint32_t pauses = 1;
+    for (uint32_t i = 0; i < net->spin; i += net->spin != ASYNC_SPIN_FOREVER) {
+        int n = async_net_poll(net, 0);
+        if (n != 0) {
+            net->spun++;
+            return n;
+        }
+        for (uint32_t p = 0; p < pauses; p++) {
+            async_cpu_pause();
+        }
+        if (pauses < net->pause_max) {
+            pauses <<= 1;
+        }
+    }
+    net->blocked++;
+    return async_net_poll(net, -1);
+}
+
+// Drive the runtime until all tasks have finished
+static inline void async_net_run(struct async_net *net)
+{
+    while (net->rt->tasks) {
+        async_run(net->rt);
+        if (net->rt->tasks && async_net_idle(net) < 0 && errno != EINTR) {
+            break;
+        }
+    }
+}
+
+static inline int async_net_try_connect(int fd, const struct sockaddr *addr,
+        socklen_t addrlen, int *res)
+{
+    *res = connect(fd, addr, addrlen);
+    if (*res < 0 && errno == EISCONN) {
+        *res = 0;
+    }
+    return *res == 0 || (errno != EINPROGRESS && errno != EALREADY && errno != EINTR);
+}
+
+// Await an fd becoming ready for events, where try is the non-blocking attempt
+// (true when done)
+#define await_io(net, fd, events, try) \
+    await((try) || !async_net_wait(net, fd, events))
+
+#define await_accept(net, fd, res)                                          \
+    await_io(net, fd, EPOLLIN, async_net_done((res) =                       \
+            accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)))
+
+#define await_connect(net, fd, addr, addrlen, res)                          \
+    await_io(net, fd, EPOLLOUT, async_net_try_connect(fd,                   \
+            (const struct sockaddr*)(addr), addrlen, &(res)))
+
+#define await_recv(net, fd, buf, len, res)                                  \
+    await_io(net, fd, EPOLLIN, async_net_done((res) =                       \
+            recv(fd, buf, len, 0)))
+
+#define await_send(net, fd, buf, len, res)                                  \
+    await_io(net, fd, EPOLLOUT, async_net_done((res) =                      \
+            send(fd, buf, len, MSG_NOSIGNAL)))
+
+#define await_recvfrom(net, fd, buf, len, addr, addrlen, res)               \
+    await_io(net, fd, EPOLLIN, async_net_done((res) =                       \
+            recvfrom(fd, buf, len, 0, (struct sockaddr*)(addr), addrlen)))
+
+#define await_sendto(net, fd, buf, len, addr, addrlen, res)                 \
+    await_io(net, fd, EPOLLOUT, async_net_done((res) =                      \
+            sendto(fd, buf, len, MSG_NOSIGNAL,                              \
+                (const struct sockaddr*)(addr), addrlen)))
+
+#endif // ASYNCC_NET_H
@@ -0,0 +1,153 @@
+// @file asyncc_pipe.h
+// Pipeline links between task stages, with credit-based backpressure
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+#ifndef ASYNCC_PIPE_H
+#define ASYNCC_PIPE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "asyncc_sync.h"
+
+// A pipeline is a chain of stages, each an async task with its own stack,
+// joined by links.  A link starts out with one credit per slot, sending an
+// item spends one, and the receiver gives it back when it is done with the
+// item.  A sender without credit parks, so a slow stage holds up the stages
+// before it instead of letting items pile up, and at most a link's size of
+// items are ever between two stages (queued, or being worked on downstream):
+//
+//   static void *parsed_ring[16];
+//   static struct async_link parsed;    // async_link_init(&parsed, &rt,
+//                                       //     parsed_ring, 16)
+//
+//   enum async parse(uint8_t *s, void *arg)     // One stage
+//   {
+//       struct stage *st = arg;
+//       async_begin(s, void *in, void *out);
+//       for (;;) {
+//           await_link_recv(s, st->in, &l->in);
+//           if (!l->in) {
+//               break;                  // Closed upstream
+//           }
+//           l->out = parse_packet(l->in);
+//           async_link_done(st->in);    // Credit back upstream
+//           await_link_send(s, st->out, l->out);
+//       }
+//       async_link_close(st->out);
+//       async_end(s);
+//   }
+//
+// Items are pointers that the stages agree on.  A stage that passes a buffer
+// on should only give the credit back once the buffer is free again.  Credit
+// freed by async_link_done() goes straight to the sender that has waited
+// longest, so a task that comes along meanwhile can't take it first.
+
+struct async_link {
+    struct async_runtime *rt;
+    void **ring;
+    uint16_t size;              // Slots in ring, a power of two
+    uint16_t head;              // Next to receive
+    uint16_t tail;              // Next to send
+    uint16_t credits;           // Sends possible without waiting
+    uint16_t peak;              // Most credits out at once
+    uint8_t closed;
+    struct async_waitq senders;
+    struct async_waitq receivers;
+    uint32_t stalls;            // Sends that had to wait for credit
+};
+
+static inline void async_link_init(struct async_link *k, struct async_runtime *rt,
+        void **ring, uint16_t size)
+{
+    k->rt = rt;
+    k->ring = ring;
+    k->size = size;
+    k->head = 0;
+    k->tail = 0;
+    k->credits = size;
+    k->peak = 0;
+    k->closed = 0;
+    async_waitq_init(&k->senders);
+    async_waitq_init(&k->receivers);
+    k->stalls = 0;
+}
+
+static inline void async_link_put(struct async_link *k, void *item)
+{
+    k->ring[k->tail++ & (k->size - 1)] = item;
+    if (k->size - k->credits > k->peak) {
+        k->peak = k->size - k->credits;
+    }
+    async_waitq_wake_one(&k->receivers, k->rt);
+}
+
+// Give back the credit of an item that was received and is done with
+static inline void async_link_done(struct async_link *k)
+{
+    // A woken sender already holds the credit
+    if (!async_waitq_wake_one(&k->senders, k->rt)) {
+        k->credits++;
+    }
+}
+
+// No more sends, receivers get NULL once the link is empty
+static inline void async_link_close(struct async_link *k)
+{
+    k->closed = 1;
+    async_waitq_wake_all(&k->receivers, k->rt);
+}
+
+// Send item, waiting for credit first if there is none (a leaf)
+static inline enum async async_link_send(uint8_t *s, struct async_link *k, void *item)
+{
+    async_inline_begin(s, struct async_waiter w, void *item);
+    if (k->credits && !k->senders.head) {
+        k->credits--;
+    } else {
+        k->stalls++;
+        l->item = item;
+        async_waitq_push(&k->senders, k->rt, &l->w);
+        await(l->w.woken || !async_park_on(k->rt, "credit"));
+        item = l->item;
+    }
+    async_link_put(k, item);
+    async_inline_end(s);
+}
+
+// Receive the next item into *item, or NULL once the link is closed and
+// empty (a leaf)
+static inline enum async async_link_recv(uint8_t *s, struct async_link *k, void **item)
+{
+    async_inline_begin(s, struct async_waiter w);
+    while (k->head == k->tail && !k->closed) {
+        async_waitq_push(&k->receivers, k->rt, &l->w);
+        await(l->w.woken || !async_park_on(k->rt, "recv"));
+    }
+    *item = k->head != k->tail ? k->ring[k->head++ & (k->size - 1)] : NULL;
+    async_inline_end(s);
+}
+
+#define await_link_send(s, k, item) await(async_link_send(s, k, item))
+#define await_link_recv(s, k, item) await(async_link_recv(s, k, (void**)(item)))
+
+#endif // ASYNCC_PIPE_H
@@ -0,0 +1,177 @@
+// @file asyncc_prof.h
+// Sampling profiler for logical async stacks (folded output)
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+#ifndef ASYNCC_PROF_H
+#define ASYNCC_PROF_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+#include "asyncc_rt.h"
+
+#ifndef ASYNC_TRACE
+#error "asyncc_prof.h needs ASYNC_TRACE (define it before including asyncc.h)"
+#endif
+
+// A C profiler only sees async_next() calling the top-level function of a
+// task, because every await returns to it.  This one samples on SIGPROF and
+// walks the logical chain of awaiting functions on the running task's stack
+// (see async_backtrace()), then writes folded stacks for flamegraph.pl:
+//
+//   static struct async_prof prof;
+//   async_prof_start(&prof, &rt, 1000);
+//   ... run ...
+//   async_prof_stop(&prof);
+//   async_prof_dump(&prof, stdout);     // | flamegraph.pl > async.svg
+//
+// Samples that land between tasks are counted as "(runtime)".  The timer is
+// process-wide CPU time, so profile one runtime thread at a time, and only
+// one profiler can be running.  The handler only copies function ids into a
+// preallocated buffer; samples past ASYNC_PROF_SAMPLES are counted as dropped.
+
+#ifndef ASYNC_PROF_SAMPLES
+#define ASYNC_PROF_SAMPLES  16384
+#endif
+
+#ifndef ASYNC_PROF_DEPTH
+#define ASYNC_PROF_DEPTH    16      // Deeper chains keep their outermost part
+#endif
+
+struct async_prof_sample {
+    uint16_t depth;
+    uint16_t fid[ASYNC_PROF_DEPTH];
+};
+
+struct async_prof {
+    struct async_runtime *rt;
+    volatile uint32_t n;
+    volatile uint32_t dropped;
+    struct sigaction old;
+    struct async_prof_sample samples[ASYNC_PROF_SAMPLES];
+};
+
+static struct async_prof *volatile async_prof_active;
+
+static inline void async_prof_signal(int sig)
+{
+    (void)sig;
+    struct async_prof *p = async_prof_active;
+    if (!p) {
+        return;
+    }
+    if (p->n >= ASYNC_PROF_SAMPLES) {
+        p->dropped++;
+        return;
+    }
+
+    struct async_prof_sample *smp = &p->samples[p->n];
+    struct async_task *t = p->rt->current;
+    smp->depth = 0;
+    if (t) {
+        struct async_frame fr[ASYNC_PROF_DEPTH];
+        smp->depth = async_backtrace(t->s, fr, ASYNC_PROF_DEPTH);
+        for (uint16_t i = 0; i < smp->depth; i++) {
+            smp->fid[i] = (uint16_t)(fr[i].func - __start_asyncc_funcs);
+        }
+    }
+    p->n++;
+}
+
+// Start sampling rt at hz samples per second of CPU time (1 to 1000000),
+// returns 0 or -1
+static inline int async_prof_start(struct async_prof *p, struct async_runtime *rt, int hz)
+{
+    if (hz <= 0 || hz > 1000000) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = async_prof_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+
+    p->rt = rt;
+    p->n = 0;
+    p->dropped = 0;
+    async_prof_active = p;
+    if (sigaction(SIGPROF, &sa, &p->old) < 0) {
+        async_prof_active = NULL;
+        return -1;
+    }
+
+    struct itimerval it;
+    it.it_interval.tv_sec = 0;
+    it.it_interval.tv_usec = 1000000 / hz;
+    it.it_value = it.it_interval;
+    return setitimer(ITIMER_PROF, &it, NULL);
+}
+
+static inline void async_prof_stop(struct async_prof *p)
+{
+    struct itimerval it;
+    memset(&it, 0, sizeof(it));
+    setitimer(ITIMER_PROF, &it, NULL);
+    sigaction(SIGPROF, &p->old, NULL);
+    async_prof_active = NULL;
+}
+
+static inline int async_prof_cmp(const void *a, const void *b)
+{
+    const struct async_prof_sample *x = a, *y = b;
+    uint16_t n = x->depth < y->depth ? x->depth : y->depth;
+    int c = memcmp(x->fid, y->fid, n * sizeof(x->fid[0]));
+    return c ? c : (int)x->depth - (int)y->depth;
+}
+
+// Write one "outer;inner;leaf count" line per distinct stack (sorts the
+// samples, so call it after async_prof_stop())
+static inline void async_prof_dump(struct async_prof *p, FILE *f)
+{
+    qsort(p->samples, p->n, sizeof(p->samples[0]), async_prof_cmp);
+    for (uint32_t i = 0, count = 1; i < p->n; i++, count++) {
+        struct async_prof_sample *smp = &p->samples[i];
+        if (i + 1 < p->n && async_prof_cmp(smp, smp + 1) == 0) {
+            continue;
+        }
+        if (!smp->depth) {
+            fputs("(runtime)", f);
+        }
+        for (uint16_t d = 0; d < smp->depth; d++) {
+            fprintf(f, "%s%s", d ? ";" : "", __start_asyncc_funcs[smp->fid[d]].name);
+        }
+        fprintf(f, " %u\n", count);
+        count = 0;
+    }
+    if (p->dropped) {
+        fprintf(f, "(dropped) %u\n", p->dropped);
+    }
+}
+
+#endif // ASYNCC_PROF_H
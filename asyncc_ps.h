@@ -0,0 +1,196 @@
+// @file asyncc_ps.h
+// Task listing for live introspection ("async ps")
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+#ifndef ASYNCC_PS_H
+#define ASYNCC_PS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "asyncc_rt.h"
+
+#ifndef ASYNC_PS
+#error "asyncc_ps.h needs ASYNC_PS (define it before including asyncc_rt.h)"
+#endif
+
+// With ASYNC_PS defined the runtime keeps a list of its unfinished tasks, a
+// resume count per task, and why each parked task is waiting, and it paints
+// new stacks so their high-water mark can be measured.  This header turns
+// that into a text table, one row per task:
+//
+//   TASK             STATE     RESUMES  USED   MAX   HWM WAIT   WHERE
+//   0x55d0c2a4e0a0   parked       1042     4   128    58 io     client_task echo.c:121
+//
+// USED is the live extent with ASYNC_TRACK_EXTENT (IDX otherwise), and WHERE
+// is the innermost function and line with ASYNC_TRACE (the top-level SPOT
+// otherwise).  async_ps_row() works over any byte stream; include
+// asyncc_net.h first to also get async_ps_task(), which serves the table on a
+// Unix socket (try "socat - UNIX-CONNECT:/path").
+//
+// The listing is built by a task on the same runtime, so it never takes a
+// lock, and it formats at most ASYNC_PS_ROWS rows per resume, so a long
+// listing does not hold up other tasks.  Tasks that finish while the listing
+// is being sent are skipped safely.
+
+#ifndef ASYNC_PS_ROWS
+#define ASYNC_PS_ROWS       8       // Rows formatted per resume
+#endif
+
+#define ASYNC_PS_ROW_LEN    128
+#define ASYNC_PS_STACK      (ASYNC_PS_ROWS * ASYNC_PS_ROW_LEN + 64)
+#define ASYNC_PS_HEADER \
+    "TASK             STATE     RESUMES  USED   MAX   HWM WAIT   WHERE\n"
+
+static inline const char *async_ps_state(uint8_t state)
+{
+    static const char *const names[] = {"done", "ready", "run", "parked", "cold"};
+    return state < sizeof(names) / sizeof(names[0]) ? names[state] : "?";
+}
+
+// Highest byte of the stack that has ever been written
+static inline uint16_t async_ps_hwm(uint8_t *s)
+{
+    uint16_t i = MAX(s);
+    while (i > ASYNC_HDR_SIZE + 2 && s[i - 1] == ASYNC_PS_PAINT) {
+        i--;
+    }
+    return i;
+}
+
+static inline void async_ps_where(uint8_t *s, char *buf, size_t len)
+{
+#ifdef ASYNC_TRACE
+    struct async_frame fr[16];
+    uint16_t n = async_backtrace(s, fr, 16);
+    if (n) {
+        const struct async_func *f = fr[n - 1].func;
+        uint16_t line = fr[n - 1].spot;
+#ifdef ASYNC_DENSE_SPOTS
+        line = async_spot_line(f->name, line);
+#endif
+        snprintf(buf, len, "%s %s:%u", f->name, f->file, line);
+        return;
+    }
+#endif
+    snprintf(buf, len, "spot %u", SPOT(s));
+}
+
+// Format the row for t into buf (at least ASYNC_PS_ROW_LEN bytes), returns
+// its length
+static inline uint16_t async_ps_row(struct async_task *t, char *buf)
+{
+    char where[64] = "-";
+    uint16_t used = 0, max = 0, hwm = 0;
+    if (t->s) {
+        used = IDX(t->s);
+#ifdef ASYNC_TRACK_EXTENT
+        if (used == ASYNC_HDR_SIZE) {
+            used = EXT(t->s);
+        }
+#endif
+        max = MAX(t->s);
+        // Reserved locals that were never written still count
+        hwm = async_ps_hwm(t->s);
+        hwm = hwm > used ? hwm : used;
+        async_ps_where(t->s, where, sizeof(where));
+    }
+    int n = snprintf(buf, ASYNC_PS_ROW_LEN, "%-16p %-6s %10u %5u %5u %5u %-6s %s\n",
+            (void*)t, async_ps_state(t->state), t->resumes, used, max, hwm,
+            t->state == ASYNC_TASK_PARKED && t->wait ? t->wait : "-", where);
+    return n < ASYNC_PS_ROW_LEN ? (uint16_t)n : ASYNC_PS_ROW_LEN - 1;
+}
+
+#ifdef ASYNCC_NET_H
+#include <sys/un.h>
+
+struct async_ps {
+    struct async_net *net;
+    int fd;                 // Listening socket, see async_ps_listen()
+};
+
+// Listening Unix socket at path (replacing a stale one), or -1
+static inline int async_ps_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+            listen(fd, 4) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+// Serve the table to each client that connects, one at a time.  Schedule it
+// with a struct async_ps as arg and a stack of ASYNC_PS_STACK bytes.
+static inline enum async async_ps_task(uint8_t *s, void *arg)
+{
+    struct async_ps *ps = arg;
+    struct async_runtime *rt = ps->net->rt;
+    async_begin(s, int conn, long n, uint16_t len, uint16_t sent,
+            char buf[ASYNC_PS_ROWS * ASYNC_PS_ROW_LEN]);
+
+    for (;;) {
+        await_accept(ps->net, ps->fd, l->conn);
+        if (l->conn < 0) {
+            async_yield;
+            continue;
+        }
+
+        l->len = (uint16_t)strlen(ASYNC_PS_HEADER);
+        memcpy(l->buf, ASYNC_PS_HEADER, l->len);
+        rt->ps_at = rt->all;
+        for (;;) {
+            for (int rows = 0; rt->ps_at && rows < ASYNC_PS_ROWS &&
+                    (size_t)l->len + ASYNC_PS_ROW_LEN <= sizeof(l->buf); rows++) {
+                l->len += async_ps_row(rt->ps_at, l->buf + l->len);
+                rt->ps_at = rt->ps_at->all_next;
+            }
+            for (l->sent = 0; l->sent < l->len; l->sent += l->n) {
+                await_send(ps->net, l->conn, l->buf + l->sent, l->len - l->sent, l->n);
+                if (l->n < 0) {
+                    break;
+                }
+            }
+            if (l->n < 0 || !rt->ps_at) {
+                break;
+            }
+            l->len = 0;
+            async_yield;
+        }
+        close(l->conn);
+    }
+
+    async_end(s);
+}
+#endif
+
+#endif // ASYNCC_PS_H
@@ -0,0 +1,173 @@
+// @file asyncc_reloc.h
+// Moving, shrinking, and compacting suspended asyncc stacks
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+#ifndef ASYNCC_RELOC_H
+#define ASYNCC_RELOC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "asyncc_rt.h"
+
+// Everything on an asyncc stack is addressed relative to the stack itself (the
+// header holds offsets, frames live at s + IDX, sub-stacks are nested byte
+// arrays), so a suspended stack can be copied somewhere else and resumed from
+// there.  The exception is a frame that stored a real pointer into its own
+// stack (l->p = l->buf, or a pointer into a sub-stack).  Those stacks are
+// "pinned": we scan for anything that looks like such a pointer and refuse to
+// move the stack if we find one (conservative, so a false positive only costs
+// a missed move).
+//
+// Pointers *into* the stack from elsewhere can't be found this way, so don't
+// move a task that has handed out the address of one of its locals.
+//
+// Define ASYNC_TRACK_EXTENT to only copy the frames that are actually live and
+// to allow shrinking a stack below its current MAX.  Without it the whole
+// MAX bytes are treated as live.
+//
+// Only move stacks that are suspended (never from inside the task itself).
+
+enum async_reloc {
+    ASYNC_RELOC_OK,
+    ASYNC_RELOC_NOSPACE,    // Live frames don't fit in the new length
+    ASYNC_RELOC_PINNED,     // Stack holds pointers into itself (or is running)
+};
+
+// Number of bytes of a suspended stack that must be preserved
+static inline uint16_t async_stack_used(uint8_t *s)
+{
+#ifdef ASYNC_TRACK_EXTENT
+    // A task that never suspended still needs its initial SPOT
+    return EXT(s) > ASYNC_HDR_SIZE + 2 ? EXT(s) : ASYNC_HDR_SIZE + 2;
+#else
+    return MAX(s);
+#endif
+}
+
+// True if any (unaligned) pointer-sized value in the live part of the stack
+// points back into the stack
+static inline int async_stack_pinned(uint8_t *s)
+{
+    uintptr_t lo = (uintptr_t)s;
+    uintptr_t hi = lo + MAX(s);
+    uint16_t used = async_stack_used(s);
+
+    for (uint16_t i = ASYNC_HDR_SIZE; i + sizeof(uintptr_t) <= used; i++) {
+        uintptr_t v;
+        memcpy(&v, s + i, sizeof(v));
+        if (v >= lo && v < hi) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Move a suspended stack from src to dst (which may overlap src) and give it a
+// new length.  Moving onto itself with a smaller len shrinks it in place.
+static inline enum async_reloc async_relocate(uint8_t *dst, uint16_t len, uint8_t *src)
+{
+    uint16_t used = async_stack_used(src);
+    if (len < used) {
+        return ASYNC_RELOC_NOSPACE;
+    }
+    if (dst != src && async_stack_pinned(src)) {
+        return ASYNC_RELOC_PINNED;
+    }
+    memmove(dst, src, used);
+    MAX(dst) = len;
+    return ASYNC_RELOC_OK;
+}
+
+// Move a task's stack (see async_relocate()), the task keeps its place in the
+// runtime
+static inline enum async_reloc async_task_move(struct async_task *t, uint8_t *dst, uint16_t len)
+{
+    if (t->state == ASYNC_TASK_RUNNING) {
+        return ASYNC_RELOC_PINNED;
+    }
+    enum async_reloc r = async_relocate(dst, len, t->s);
+    if (r == ASYNC_RELOC_OK) {
+        t->s = dst;
+    }
+    return r;
+}
+
+// A bump allocator for task stacks that can be compacted.  Finished tasks
+// leave holes; async_arena_compact() slides the remaining stacks down over
+// them and lowers the top so the space can be handed out again.
+struct async_arena {
+    uint8_t *base;
+    uint8_t *top;
+    uint8_t *end;
+};
+
+static inline void async_arena_init(struct async_arena *a, uint8_t *mem, size_t len)
+{
+    a->base = mem;
+    a->top = mem;
+    a->end = mem + len;
+}
+
+// Returns NULL when the arena is full (try compacting first)
+static inline uint8_t *async_arena_alloc(struct async_arena *a, uint16_t len)
+{
+    if ((size_t)(a->end - a->top) < len) {
+        return NULL;
+    }
+    uint8_t *s = a->top;
+    a->top += len;
+    return s;
+}
+
+// Compact the stacks of the n live tasks in tasks (all allocated from this
+// arena, finished ones are just left out).  The array is sorted by address
+// as a side effect.  Pinned and running tasks stay where they are and the
+// others are packed around them.  Returns the number of tasks that moved.
+static inline uint16_t async_arena_compact(struct async_arena *a,
+        struct async_task **tasks, uint16_t n)
+{
+    // Insertion sort, this is not expected to run often or on huge arrays
+    for (uint16_t i = 1; i < n; i++) {
+        struct async_task *t = tasks[i];
+        uint16_t j = i;
+        for (; j > 0 && tasks[j - 1]->s > t->s; j--) {
+            tasks[j] = tasks[j - 1];
+        }
+        tasks[j] = t;
+    }
+
+    uint8_t *cursor = a->base;
+    uint16_t moved = 0;
+    for (uint16_t i = 0; i < n; i++) {
+        struct async_task *t = tasks[i];
+        if (t->s != cursor && async_task_move(t, cursor, MAX(t->s)) == ASYNC_RELOC_OK) {
+            moved++;
+        }
+        cursor = t->s + MAX(t->s);
+    }
+    a->top = cursor;
+    return moved;
+}
+
+#endif // ASYNCC_RELOC_H
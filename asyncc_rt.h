@@ -0,0 +1,400 @@
+// @file asyncc_rt.h
+// Minimal task runtime for asyncc (ready queue and parking)
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+#ifndef ASYNCC_RT_H
+#define ASYNCC_RT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "asyncc.h"
+
+// A runtime is a FIFO of ready tasks.  Each task is a top-level async function
+// plus its stack, and all of the task memory is provided by the caller (static
+// allocation friendly, the runtime never allocates).
+//
+// Tasks that return ASYNC_CONT without parking are simply put back at the end
+// of the queue, so plain await()/async_yield code keeps its polling behavior.
+// Tasks that park (see async_park()) are left out of the queue until something
+// calls async_wake() on them, which is how I/O, timers, and friends avoid
+// polling every task on every pass.
+//
+// Wakeups may be spurious, so anything that parks must re-check its condition
+// when resumed (the await_*() helpers built on this all do).  Note that parking
+// applies to the whole task: a fork-join await where one branch parks and
+// another branch only polls will not be polled again until the parked branch
+// is woken.
+
+struct async_task;
+typedef enum async (*async_task_fn)(uint8_t *s, void *arg);
+
+#ifndef ASYNC_CACHE_LINE
+#define ASYNC_CACHE_LINE 64
+#endif
+
+#ifndef ASYNC_PS_PAINT
+#define ASYNC_PS_PAINT  0xA5    // Fill for unused stack (with ASYNC_PS)
+#endif
+
+// Define ASYNC_MONITOR (and ASYNC_NOW(), a free-running uint32_t clock in any
+// unit) to keep a histogram of loop lag, the time from a task becoming ready
+// to it being resumed, and to let a watchdog catch resumes that run too long:
+//
+//   #define ASYNC_MONITOR
+//   #define ASYNC_NOW() micros()
+//
+//   void watchdog_isr(void)     // Or a thread, every few milliseconds
+//   {
+//       if (async_watchdog(&rt, micros(), 5000)) {
+//           log_stall(&rt.stall);
+//       }
+//   }
+//
+// rt.lag[b] counts resumes that waited less than 2^b clock units (and at
+// least 2^(b-1)), and async_lag_percentile() reads it back.  The watchdog
+// only reads the runtime, so it can run in an ISR or on another thread, and
+// it reports each long resume once, with the task's stack header and SPOT
+// (and its backtrace with ASYNC_TRACE) as they were when it was caught.
+// This costs two clock reads per resume.
+#ifdef ASYNC_MONITOR
+#ifndef ASYNC_NOW
+#error "ASYNC_MONITOR needs ASYNC_NOW() (a uint32_t clock, in any unit)"
+#endif
+
+#ifndef ASYNC_LAG_BUCKETS
+#define ASYNC_LAG_BUCKETS   24
+#endif
+
+#ifndef ASYNC_STALL_DEPTH
+#define ASYNC_STALL_DEPTH   8
+#endif
+
+struct async_stall {
+    struct async_task *task;
+    uint32_t started;           // ASYNC_NOW() when the resume started
+    uint32_t ran;               // How long it had run when it was caught
+    uint16_t idx;               // Stack header (frame depth at the time)
+    uint16_t max;
+    uint16_t spot;              // SPOT() of the top-level function
+#ifdef ASYNC_TRACE
+    uint16_t depth;
+    struct async_frame frames[ASYNC_STALL_DEPTH];
+#endif
+};
+#endif
+
+enum async_task_state {
+    ASYNC_TASK_DONE,        // Not scheduled (never started, or finished)
+    ASYNC_TASK_READY,       // Waiting in the ready queue
+    ASYNC_TASK_RUNNING,     // Being resumed right now
+    ASYNC_TASK_PARKED,      // Waiting for async_wake()
+    ASYNC_TASK_COLD,        // Stack swapped out, wakeups are ignored until it
+                            // is restored (see asyncc_hibernate.h)
+};
+
+struct async_task {
+    struct async_task *next;    // Ready queue link
+    async_task_fn fn;
+    void *arg;
+    uint8_t *s;
+    uint8_t state;
+#ifdef ASYNC_MONITOR
+    uint32_t ready_at;          // ASYNC_NOW() when it last became ready
+#endif
+#ifdef ASYNC_PS
+    struct async_task *all_next;    // Every unfinished task (asyncc_ps.h)
+    struct async_task *all_prev;
+    const char *wait;           // Why it parked
+    uint32_t resumes;
+#endif
+};
+
+struct async_runtime {
+    struct async_task *head;
+    struct async_task *tail;
+    struct async_task *current; // Task being resumed (NULL between tasks)
+    uint16_t tasks;             // Number of tasks that have not finished
+#ifdef ASYNC_MONITOR
+    uint32_t lag[ASYNC_LAG_BUCKETS];
+    uint32_t resume_at;         // ASYNC_NOW() when current was resumed
+    uint32_t resumes;           // Published after current and resume_at
+    uint32_t reported;          // Last resume the watchdog reported
+    uint32_t stalls;
+    struct async_stall stall;   // The last one
+#endif
+#ifdef ASYNC_PS
+    struct async_task *all;
+    struct async_task *ps_at;   // Next task the ps listing will show
+#endif
+#ifdef ASYNC_METRICS
+    // On cache lines of their own, so readers on other threads (see
+    // asyncc_metrics.h) don't slow down the runtime's own writes
+    uint64_t m[ASYNC_M_COUNT] __attribute__((aligned(ASYNC_CACHE_LINE)));
+#endif
+};
+
+#ifdef ASYNC_METRICS
+#define async_rt_count(rt, id, n)   async_metric_add((rt)->m, id, n)
+#else
+#define async_rt_count(rt, id, n)   ((void)0)
+#endif
+
+static inline void async_rt_init(struct async_runtime *rt)
+{
+    rt->head = NULL;
+    rt->tail = NULL;
+    rt->current = NULL;
+    rt->tasks = 0;
+#ifdef ASYNC_MONITOR
+    for (uint16_t b = 0; b < ASYNC_LAG_BUCKETS; b++) {
+        rt->lag[b] = 0;
+    }
+    rt->resumes = 0;
+    rt->reported = 0;
+    rt->stalls = 0;
+#endif
+#ifdef ASYNC_PS
+    rt->all = NULL;
+    rt->ps_at = NULL;
+#endif
+#ifdef ASYNC_METRICS
+    for (uint16_t i = 0; i < ASYNC_M_COUNT; i++) {
+        rt->m[i] = 0;
+    }
+#endif
+}
+
+static inline void async_rt_push(struct async_runtime *rt, struct async_task *t)
+{
+#ifdef ASYNC_MONITOR
+    t->ready_at = ASYNC_NOW();
+#endif
+    t->state = ASYNC_TASK_READY;
+    t->next = NULL;
+#ifdef ASYNC_METRICS
+    async_rt_count(rt, ASYNC_M_PUSHES, 1);
+    if (rt->m[ASYNC_M_PUSHES] - rt->m[ASYNC_M_RESUMES] > rt->m[ASYNC_M_READY_MAX]) {
+        async_rt_count(rt, ASYNC_M_READY_MAX, 1);
+    }
+#endif
+    if (rt->tail) {
+        rt->tail->next = t;
+    } else {
+        rt->head = t;
+    }
+    rt->tail = t;
+}
+
+// Init the task's stack and add it to the ready queue
+static inline void async_sched(struct async_runtime *rt, struct async_task *t,
+        async_task_fn fn, void *arg, uint8_t *s, uint16_t len)
+{
+    async_init(s, len);
+    t->fn = fn;
+    t->arg = arg;
+    t->s = s;
+    rt->tasks++;
+#ifdef ASYNC_PS
+    // Paint the stack so its high-water mark can be found later
+    for (uint16_t i = ASYNC_HDR_SIZE + 2; i < len; i++) {
+        s[i] = ASYNC_PS_PAINT;
+    }
+    t->wait = NULL;
+    t->resumes = 0;
+    t->all_prev = NULL;
+    t->all_next = rt->all;
+    if (rt->all) {
+        rt->all->all_prev = t;
+    }
+    rt->all = t;
+#endif
+    async_rt_push(rt, t);
+}
+
+// Make a parked task runnable again (no-op for ready or finished tasks).  A
+// wakeup for the task that is currently running is remembered, so it is not
+// lost if the task parks later in the same resume.
+static inline void async_wake(struct async_runtime *rt, struct async_task *t)
+{
+    if (t->state == ASYNC_TASK_PARKED && t != rt->current) {
+        async_rt_count(rt, ASYNC_M_WAKES, 1);
+        async_rt_push(rt, t);
+    } else if (t->state == ASYNC_TASK_PARKED || t->state == ASYNC_TASK_RUNNING) {
+        t->state = ASYNC_TASK_READY;
+    }
+}
+
+// Park the current task until async_wake().  Always returns 1 so it can be used
+// inside await conditions, e.g. await(ready(x) || !async_park(rt)).  why is
+// a static string that introspection shows for the parked task.
+static inline int async_park_on(struct async_runtime *rt, const char *why)
+{
+#ifdef ASYNC_PS
+    rt->current->wait = why;
+#else
+    (void)why;
+#endif
+    if (rt->current->state == ASYNC_TASK_RUNNING) {
+        rt->current->state = ASYNC_TASK_PARKED;
+    }
+    return 1;
+}
+
+static inline int async_park(struct async_runtime *rt)
+{
+    return async_park_on(rt, "park");
+}
+
+#define await_parked(rt, cond) await((cond) || !async_park(rt))
+
+// Resume the next ready task, returns 0 if there was nothing to run
+static inline int async_next(struct async_runtime *rt)
+{
+    struct async_task *t = rt->head;
+    if (!t) {
+        return 0;
+    }
+    rt->head = t->next;
+    if (!rt->head) {
+        rt->tail = NULL;
+    }
+
+    t->state = ASYNC_TASK_RUNNING;
+#ifdef ASYNC_METRICS
+    async_rt_count(rt, ASYNC_M_RESUMES, 1);
+    uint64_t *prev_metrics = async_metrics_cur;
+    async_metrics_cur = rt->m;
+#endif
+#ifdef ASYNC_MONITOR
+    uint32_t now = ASYNC_NOW(), lag = now - t->ready_at;
+    uint16_t b = 0;
+    while (lag && b < ASYNC_LAG_BUCKETS - 1) {
+        lag >>= 1;
+        b++;
+    }
+    rt->lag[b]++;
+    __atomic_store_n(&rt->current, t, __ATOMIC_RELAXED);
+    __atomic_store_n(&rt->resume_at, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&rt->resumes, rt->resumes + 1, __ATOMIC_RELEASE);
+    enum async status = t->fn(t->s, t->arg);
+    __atomic_store_n(&rt->current, NULL, __ATOMIC_RELAXED);
+#else
+    rt->current = t;
+    enum async status = t->fn(t->s, t->arg);
+    rt->current = NULL;
+#endif
+#ifdef ASYNC_METRICS
+    async_metrics_cur = prev_metrics;     // Nested or other runtimes
+#endif
+
+#ifdef ASYNC_PS
+    t->resumes++;
+#endif
+
+    if (status != ASYNC_CONT) {
+        t->state = ASYNC_TASK_DONE;
+        rt->tasks--;
+#ifdef ASYNC_PS
+        if (rt->ps_at == t) {
+            rt->ps_at = t->all_next;
+        }
+        if (t->all_next) {
+            t->all_next->all_prev = t->all_prev;
+        }
+        if (t->all_prev) {
+            t->all_prev->all_next = t->all_next;
+        } else {
+            rt->all = t->all_next;
+        }
+#endif
+    } else if (t->state != ASYNC_TASK_PARKED) {
+        async_rt_count(rt, ASYNC_M_YIELDS, 1);
+        async_rt_push(rt, t);
+    } else {
+        async_rt_count(rt, ASYNC_M_PARKS, 1);
+    }
+    return 1;
+}
+
+// Run until every task has either finished or parked
+static inline void async_run(struct async_runtime *rt)
+{
+    while (async_next(rt)) {
+    }
+}
+
+#ifdef ASYNC_MONITOR
+// Upper bound of the loop lag (in ASYNC_NOW() units) that pct percent of the
+// resumes so far stayed under
+static inline uint32_t async_lag_percentile(struct async_runtime *rt, uint8_t pct)
+{
+    uint64_t total = 0, seen = 0;
+    for (uint16_t b = 0; b < ASYNC_LAG_BUCKETS; b++) {
+        total += rt->lag[b];
+    }
+    for (uint16_t b = 0; b < ASYNC_LAG_BUCKETS; b++) {
+        seen += rt->lag[b];
+        if (seen * 100 >= total * pct) {
+            return b ? (uint32_t)1 << b : 0;
+        }
+    }
+    return UINT32_MAX;
+}
+
+// Check whether the task being resumed has run for limit or more (now is
+// ASYNC_NOW()).  Returns 1 the first time a resume is caught, and fills in
+// rt->stall.  Call it from one watchdog only.
+static inline int async_watchdog(struct async_runtime *rt, uint32_t now, uint32_t limit)
+{
+    uint32_t resumes = __atomic_load_n(&rt->resumes, __ATOMIC_ACQUIRE);
+    struct async_task *t = __atomic_load_n(&rt->current, __ATOMIC_RELAXED);
+    uint32_t at = __atomic_load_n(&rt->resume_at, __ATOMIC_RELAXED);
+    if (!t || resumes == rt->reported || now - at < limit) {
+        return 0;
+    }
+
+    struct async_stall st;
+    st.task = t;
+    st.started = at;
+    st.ran = now - at;
+    st.idx = IDX(t->s);
+    st.max = MAX(t->s);
+    st.spot = SPOT(t->s);
+#ifdef ASYNC_TRACE
+    st.depth = async_backtrace(t->s, st.frames, ASYNC_STALL_DEPTH);
+#endif
+
+    // Only report it if the same resume was still running after the copy
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&rt->resumes, __ATOMIC_RELAXED) != resumes ||
+            __atomic_load_n(&rt->current, __ATOMIC_RELAXED) != t) {
+        return 0;
+    }
+    rt->stall = st;
+    rt->reported = resumes;
+    rt->stalls++;
+    return 1;
+}
+#endif
+
+#endif // ASYNCC_RT_H
@@ -0,0 +1,324 @@
+// @file asyncc_shm.h
+// Shared-memory message channel between processes
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+#ifndef ASYNCC_SHM_H
+#define ASYNCC_SHM_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include "asyncc_net.h"
+
+// A one-way channel of variable-length messages between two processes (or
+// threads): a ring buffer in a memfd mapped by both sides, plus one eventfd
+// per direction for wakeups.  Messages are written and read in place, so
+// nothing is copied, and as long as neither side has to wait there are no
+// syscalls at all.  A side that finds the ring empty (or full) sets a flag in
+// the shared header and waits for its eventfd through the epoll reactor; the
+// other side only writes the eventfd when it sees that flag.
+//
+//   // Producer                         // Consumer
+//   await_chan_reserve(&net, &ch,       await_chan_recv(&net, &ch,
+//           l->p, 64);                          l->p, l->n);
+//   fill(l->p);                         use(l->p, l->n);
+//   async_chan_commit(&ch);             async_chan_release(&ch);
+//
+// One producer and one consumer per channel, use two channels for replies.
+// Create the channel before fork(), or pass the three fds (memfd, data
+// eventfd, space eventfd) over a Unix socket and attach on the other side.
+// They are created close-on-exec, clear that flag to pass them through exec.
+//
+// The ring is shared with the other process, so nothing read from it is
+// trusted: each side keeps its own copy of the capacity (checked against the
+// size of the memfd when attaching), and positions, lengths, and padding
+// that would point outside the ring mark the channel broken (err is set to
+// EPROTO) instead of being followed.  The awaits then finish with a NULL
+// pointer.  A message too big to ever fit (more than cap / 2 - 8 bytes)
+// fails the same way with EMSGSIZE.
+//
+// memfd_create() needs _GNU_SOURCE, the same as accept4() in asyncc_net.h.
+
+#define ASYNC_CHAN_MAGIC    0x4E414843u     // "CHAN"
+#define ASYNC_CHAN_PAD      0xFFFFFFFFu     // Skip to the start of the ring
+
+struct async_chan_ring {
+    uint32_t magic;
+    uint32_t cap;                           // Data bytes, a power of two
+    _Alignas(64) _Atomic uint32_t head;     // Consumer position
+    _Atomic uint32_t rd_wait;               // Consumer is waiting for data
+    _Alignas(64) _Atomic uint32_t tail;     // Producer position
+    _Atomic uint32_t wr_wait;               // Producer is waiting for space
+    _Alignas(64) uint8_t data[];
+};
+
+// Each side has its own struct async_chan around the shared ring
+struct async_chan {
+    struct async_chan_ring *ring;
+    uint32_t cap;           // This side's copy of ring->cap
+    int err;                // 0, EPROTO (broken ring), or EMSGSIZE
+    uint32_t pos;           // Reserved or peeked message, until commit or
+    uint32_t rec;           // release (ring position and record length)
+    int memfd;
+    int data_fd;            // Eventfd the producer kicks
+    int space_fd;           // Eventfd the consumer kicks
+    uint32_t waits;         // Slow path counters (this side's waits, and the
+    uint32_t kicks;         // eventfd writes it made)
+};
+
+// Records are a 32-bit length and the message, padded to 8 bytes
+static inline uint32_t async_chan_rec(uint32_t len)
+{
+    return (4 + len + 7) & ~7u;
+}
+
+// Map an existing channel from its fds, returns 0 or -1
+static inline int async_chan_attach(struct async_chan *ch, int memfd, int data_fd,
+        int space_fd)
+{
+    struct async_chan_ring hdr;
+    struct stat st;
+    if (pread(memfd, &hdr, sizeof(hdr.magic) + sizeof(hdr.cap), 0) !=
+                (ssize_t)(sizeof(hdr.magic) + sizeof(hdr.cap)) ||
+            hdr.magic != ASYNC_CHAN_MAGIC || fstat(memfd, &st) < 0) {
+        return -1;
+    }
+    // The whole ring has to be backed by the memfd
+    if (hdr.cap < 16 || (hdr.cap & (hdr.cap - 1)) ||
+            (uint64_t)st.st_size < sizeof(hdr) + (uint64_t)hdr.cap) {
+        return -1;
+    }
+    ch->ring = mmap(NULL, sizeof(hdr) + hdr.cap, PROT_READ | PROT_WRITE,
+            MAP_SHARED, memfd, 0);
+    if (ch->ring == MAP_FAILED) {
+        return -1;
+    }
+    ch->cap = hdr.cap;
+    ch->err = 0;
+    ch->pos = 0;
+    ch->rec = 0;
+    ch->memfd = memfd;
+    ch->data_fd = data_fd;
+    ch->space_fd = space_fd;
+    ch->waits = 0;
+    ch->kicks = 0;
+    return 0;
+}
+
+// Create a channel with room for cap bytes of records (a power of two, and
+// messages can be at most cap / 2 - 8 bytes), returns 0 or -1
+static inline int async_chan_create(struct async_chan *ch, uint32_t cap)
+{
+    struct async_chan_ring hdr = { .magic = ASYNC_CHAN_MAGIC, .cap = cap };
+    int memfd = memfd_create("asyncc_chan", MFD_CLOEXEC);
+    int data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (memfd < 0 || data_fd < 0 || space_fd < 0 || (cap & (cap - 1)) ||
+            ftruncate(memfd, sizeof(hdr) + cap) < 0 ||
+            pwrite(memfd, &hdr, sizeof(hdr), 0) < 0 ||
+            async_chan_attach(ch, memfd, data_fd, space_fd) < 0) {
+        close(memfd);
+        close(data_fd);
+        close(space_fd);
+        return -1;
+    }
+    return 0;
+}
+
+static inline void async_chan_close(struct async_chan *ch)
+{
+    munmap(ch->ring, sizeof(*ch->ring) + ch->cap);
+    close(ch->memfd);
+    close(ch->data_fd);
+    close(ch->space_fd);
+}
+
+// Wake the other side if it said it was waiting (the full fence pairs with
+// the one in async_chan_wait(), so either it sees our update or we see its
+// flag)
+static inline void async_chan_kick(struct async_chan *ch, _Atomic uint32_t *wait, int fd)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(wait, memory_order_relaxed) &&
+            atomic_exchange_explicit(wait, 0, memory_order_relaxed)) {
+        uint64_t one = 1;
+        ch->kicks++;
+        if (write(fd, &one, sizeof(one)) < 0) {
+            // The counter can't overflow in practice, and a full counter
+            // means the other side is already awake
+        }
+    }
+}
+
+// Reserve room for a message of len bytes, returns where to write it or NULL
+// if the ring is full (or err is set)
+static inline uint8_t *async_chan_reserve(struct async_chan *ch, uint32_t len)
+{
+    struct async_chan_ring *r = ch->ring;
+    uint32_t cap = ch->cap;
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint32_t pos = tail & (cap - 1);
+    uint32_t rec = async_chan_rec(len);
+    uint32_t skip = cap - pos < rec ? cap - pos : 0;
+
+    if (len > cap / 2 - 8) {
+        ch->err = EMSGSIZE;     // Would never fit, even in an empty ring
+        return NULL;
+    }
+    if (ch->err == EMSGSIZE) {
+        ch->err = 0;
+    }
+    if (tail - head > cap) {
+        ch->err = EPROTO;
+    }
+    if (ch->err) {
+        return NULL;
+    }
+    if (cap - (tail - head) < skip + rec) {
+        ch->rec = skip + rec;   // What async_chan_has_space() waits for
+        return NULL;
+    }
+    if (skip) {
+        *(uint32_t*)(r->data + pos) = ASYNC_CHAN_PAD;
+        pos = 0;
+    }
+    *(uint32_t*)(r->data + pos) = len;
+    ch->pos = tail + skip;
+    ch->rec = rec;
+    return r->data + pos + 4;
+}
+
+// Publish the reserved message
+static inline void async_chan_commit(struct async_chan *ch)
+{
+    atomic_store_explicit(&ch->ring->tail, ch->pos + ch->rec, memory_order_release);
+    async_chan_kick(ch, &ch->ring->rd_wait, ch->data_fd);
+}
+
+// Get the next message and its length, or NULL if there is none (or err is
+// set).  Every length is read once, then checked against what the producer
+// has published and against the end of the ring.
+static inline uint8_t *async_chan_peek(struct async_chan *ch, uint32_t *len)
+{
+    struct async_chan_ring *r = ch->ring;
+    uint32_t cap = ch->cap;
+    uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    if (head == tail || ch->err) {
+        return NULL;
+    }
+    uint32_t avail = tail - head;
+    uint32_t pos = head & (cap - 1);
+    uint32_t n = __atomic_load_n((uint32_t*)(r->data + pos), __ATOMIC_RELAXED);
+    if (avail > cap || avail < 8) {
+        goto broken;
+    }
+    if (n == ASYNC_CHAN_PAD) {
+        // The padding runs to the end of the ring, and a record follows it
+        if (avail - 8 < cap - pos) {
+            goto broken;
+        }
+        avail -= cap - pos;
+        head += cap - pos;
+        pos = 0;
+        n = __atomic_load_n((uint32_t*)r->data, __ATOMIC_RELAXED);
+    }
+    if (n > cap - pos - 4 || async_chan_rec(n) > avail) {
+        goto broken;
+    }
+    *len = n;
+    ch->pos = head;
+    ch->rec = async_chan_rec(n);
+    return r->data + pos + 4;
+broken:
+    ch->err = EPROTO;
+    return NULL;
+}
+
+// Done with the message from async_chan_peek(), hand its space back
+static inline void async_chan_release(struct async_chan *ch)
+{
+    atomic_store_explicit(&ch->ring->head, ch->pos + ch->rec, memory_order_release);
+    async_chan_kick(ch, &ch->ring->wr_wait, ch->space_fd);
+}
+
+// Slow path of the awaits below: announce that we are waiting, then check
+// once more before parking on the eventfd.  Returns 1 to keep waiting (parked,
+// or ready to retry right away), or 0 if epoll refused the fd.
+static inline int async_chan_wait(struct async_net *net, struct async_chan *ch,
+        _Atomic uint32_t *wait, int fd, int (*ready)(struct async_chan *ch))
+{
+    uint64_t count;
+    if (ch->err) {
+        return 0;
+    }
+    ch->waits++;
+    async_rt_count(net->rt, wait == &ch->ring->rd_wait ?
+            ASYNC_M_CHAN_EMPTY : ASYNC_M_CHAN_FULL, 1);
+    if (read(fd, &count, sizeof(count)) < 0) {
+        // Nothing pending (EAGAIN)
+    }
+    atomic_store_explicit(wait, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (ready(ch)) {
+        atomic_store_explicit(wait, 0, memory_order_relaxed);
+        return 1;
+    }
+    return async_net_wait(net, fd, EPOLLIN);
+}
+
+static inline int async_chan_has_data(struct async_chan *ch)
+{
+    return atomic_load_explicit(&ch->ring->head, memory_order_relaxed) !=
+        atomic_load_explicit(&ch->ring->tail, memory_order_relaxed);
+}
+
+static inline int async_chan_has_space(struct async_chan *ch)
+{
+    return ch->cap - (atomic_load_explicit(&ch->ring->tail, memory_order_relaxed) -
+        atomic_load_explicit(&ch->ring->head, memory_order_relaxed)) >= ch->rec;
+}
+
+// Await a message: ptr and len (locals) are set to the message in the ring,
+// or ptr is NULL if waiting failed.  Call async_chan_release() when done.
+#define await_chan_recv(net, ch, ptr, len)                                  \
+    await(((ptr) = async_chan_peek(ch, &(len))) ||                          \
+            !async_chan_wait(net, ch, &(ch)->ring->rd_wait, (ch)->data_fd,  \
+                async_chan_has_data))
+
+// Await room for a message of len bytes: ptr (a local) is set to where to
+// write it, or NULL if waiting failed.  Call async_chan_commit() when done.
+#define await_chan_reserve(net, ch, ptr, len)                               \
+    await(((ptr) = async_chan_reserve(ch, len)) ||                          \
+            !async_chan_wait(net, ch, &(ch)->ring->wr_wait, (ch)->space_fd, \
+                async_chan_has_space))
+
+#endif // ASYNCC_SHM_H
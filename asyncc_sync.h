@@ -0,0 +1,262 @@
+// @file asyncc_sync.h
+// Read-write lock, once, and shared futures for tasks on one runtime
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+#ifndef ASYNCC_SYNC_H
+#define ASYNCC_SYNC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "asyncc_rt.h"
+
+// Waiting tasks park on a wait queue and are woken by whoever releases what
+// they wait for, so nothing polls.  The waiter sits in the locals of a leaf
+// (like a timer), so a wait must run to completion: don't wait in a fork-join
+// branch that may be abandoned.  These are for tasks of one runtime, use
+// RTOS primitives (or a channel) across threads.
+//
+//   static struct async_rwlock table_lock;     // async_rwlock_init(&.., &rt)
+//
+//   enum async lookup(uint8_t *s, uint32_t key)
+//   {
+//       async_begin(s);
+//       await_rdlock(s, &table_lock);
+//       ...                             // Read the table, awaits are fine
+//       async_rdunlock(&table_lock);
+//       async_end(s);
+//   }
+//
+// The lock is handed over on release: a woken task already holds it, so a
+// task that comes along in between can't take it first.  Readers and writers
+// take turns: once a writer waits new readers queue behind it, a writer that
+// unlocks lets in every reader that queued meanwhile, and the next writer
+// goes when they are done, so a stream of either can't starve the other.
+//
+// A shared future is a value that many tasks wait for and one sets:
+//
+//   static struct async_future cfg;            // async_future_init(&.., &rt)
+//
+//   await_once(s, &cfg, load_config(s, &config));  // The first caller loads
+//   use(&config);                                   // it, the rest wait
+//
+// await_future(s, f) waits for it without ever computing it, and
+// async_future_set(f, value) completes it and wakes every waiter at once.
+
+struct async_waiter {
+    struct async_waiter *next;
+    struct async_task *task;
+    uint8_t woken;
+};
+
+// FIFO of waiters
+struct async_waitq {
+    struct async_waiter *head;
+    struct async_waiter *tail;
+};
+
+static inline void async_waitq_init(struct async_waitq *q)
+{
+    q->head = NULL;
+    q->tail = NULL;
+}
+
+static inline void async_waitq_push(struct async_waitq *q, struct async_runtime *rt,
+        struct async_waiter *w)
+{
+    w->next = NULL;
+    w->task = rt->current;
+    w->woken = 0;
+    if (q->tail) {
+        q->tail->next = w;
+    } else {
+        q->head = w;
+    }
+    q->tail = w;
+}
+
+// Wake the first waiter, returns 0 if there was none
+static inline int async_waitq_wake_one(struct async_waitq *q, struct async_runtime *rt)
+{
+    struct async_waiter *w = q->head;
+    if (!w) {
+        return 0;
+    }
+    q->head = w->next;
+    if (!q->head) {
+        q->tail = NULL;
+    }
+    w->woken = 1;
+    async_wake(rt, w->task);
+    return 1;
+}
+
+// Wake every waiter, returns how many there were
+static inline uint16_t async_waitq_wake_all(struct async_waitq *q, struct async_runtime *rt)
+{
+    uint16_t n = 0;
+    while (async_waitq_wake_one(q, rt)) {
+        n++;
+    }
+    return n;
+}
+
+// Park on q until woken (a leaf)
+static inline enum async async_waitq_wait(uint8_t *s, struct async_waitq *q,
+        struct async_runtime *rt, const char *why)
+{
+    async_inline_begin(s, struct async_waiter w);
+    async_waitq_push(q, rt, &l->w);
+    await(l->w.woken || !async_park_on(rt, why));
+    async_inline_end(s);
+}
+
+struct async_rwlock {
+    struct async_runtime *rt;
+    uint16_t readers;           // Holding it
+    uint8_t writer;             // Held by a writer
+    struct async_waitq rq;      // Waiting readers
+    struct async_waitq wq;      // Waiting writers
+};
+
+static inline void async_rwlock_init(struct async_rwlock *lk, struct async_runtime *rt)
+{
+    lk->rt = rt;
+    lk->readers = 0;
+    lk->writer = 0;
+    async_waitq_init(&lk->rq);
+    async_waitq_init(&lk->wq);
+}
+
+static inline int async_rwlock_try_rd(struct async_rwlock *lk)
+{
+    if (lk->writer || lk->wq.head) {
+        return 0;
+    }
+    lk->readers++;
+    return 1;
+}
+
+static inline int async_rwlock_try_wr(struct async_rwlock *lk)
+{
+    if (lk->writer || lk->readers) {
+        return 0;
+    }
+    lk->writer = 1;
+    return 1;
+}
+
+#define await_rdlock(s, lk)                                         \
+    if (!async_rwlock_try_rd(lk)) {                                 \
+        await(async_waitq_wait(s, &(lk)->rq, (lk)->rt, "rdlock"));  \
+    }
+
+#define await_wrlock(s, lk)                                         \
+    if (!async_rwlock_try_wr(lk)) {                                 \
+        await(async_waitq_wait(s, &(lk)->wq, (lk)->rt, "wrlock"));  \
+    }
+
+static inline void async_rdunlock(struct async_rwlock *lk)
+{
+    if (--lk->readers == 0 && async_waitq_wake_one(&lk->wq, lk->rt)) {
+        lk->writer = 1;
+    }
+}
+
+static inline void async_wrunlock(struct async_rwlock *lk)
+{
+    lk->writer = 0;
+    lk->readers = async_waitq_wake_all(&lk->rq, lk->rt);
+    if (!lk->readers && async_waitq_wake_one(&lk->wq, lk->rt)) {
+        lk->writer = 1;         // Still held, by the next writer
+    }
+}
+
+enum async_future_state {
+    ASYNC_FUTURE_EMPTY,
+    ASYNC_FUTURE_RUNNING,       // Claimed by await_once()
+    ASYNC_FUTURE_READY,
+};
+
+struct async_future {
+    struct async_runtime *rt;
+    void *value;
+    uint8_t *owner;             // Stack of the task computing it
+    uint8_t state;
+    struct async_waitq waiters;
+};
+
+static inline void async_future_init(struct async_future *f, struct async_runtime *rt)
+{
+    f->rt = rt;
+    f->value = NULL;
+    f->owner = NULL;
+    f->state = ASYNC_FUTURE_EMPTY;
+    async_waitq_init(&f->waiters);
+}
+
+static inline int async_future_ready(struct async_future *f)
+{
+    return f->state == ASYNC_FUTURE_READY;
+}
+
+// Complete f and wake everything waiting for it, always returns 1
+static inline int async_future_set(struct async_future *f, void *value)
+{
+    f->value = value;
+    f->state = ASYNC_FUTURE_READY;
+    async_waitq_wake_all(&f->waiters, f->rt);
+    return 1;
+}
+
+// Take the job of computing f for stack s, returns 1 if it is (or already
+// was) the job of s
+static inline int async_future_claim(struct async_future *f, uint8_t *s)
+{
+    if (f->state == ASYNC_FUTURE_EMPTY) {
+        f->state = ASYNC_FUTURE_RUNNING;
+        f->owner = s;
+    }
+    return f->state == ASYNC_FUTURE_RUNNING && f->owner == s;
+}
+
+// Park until f is ready (a leaf)
+static inline enum async async_future_wait(uint8_t *s, struct async_future *f)
+{
+    async_inline_begin(s, struct async_waiter w);
+    if (!async_future_ready(f)) {
+        async_waitq_push(&f->waiters, f->rt, &l->w);
+        await(l->w.woken || !async_park_on(f->rt, "future"));
+    }
+    async_inline_end(s);
+}
+
+#define await_future(s, f) await(async_future_wait(s, f))
+
+// The first task to get here awaits call and then completes f (with a NULL
+// value), every other task waits for that.  One await does both, the claim
+// tells them apart on every resume.
+#define await_once(s, f, call)                                      \
+    await_call(async_future_claim(f, s) ?                           \
+            (call) && async_future_set(f, NULL) : async_future_wait(s, f))
+
+#endif // ASYNCC_SYNC_H
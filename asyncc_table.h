@@ -0,0 +1,133 @@
+// @file asyncc_table.h
+// Compile-time task tables with a statically scheduled dispatcher
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+#ifndef ASYNCC_TABLE_H
+#define ASYNCC_TABLE_H
+
+#include <stdint.h>
+#include "asyncc.h"
+
+// For systems where every task is known at build time:
+//
+//   enum async blink(uint8_t *s);
+//   enum async uart_rx(uint8_t *s);
+//
+//   ASYNC_TASK_TABLE(app,
+//       (uart_rx, 64, 0),     // (function, stack length, priority)
+//       (blink,   32, 1));
+//
+//   int main(void) { app_init(); app_run(); }
+//
+// (examples/table.c is a complete one.)
+// This expands to a statically sized stack per task, a const table of the
+// tasks app_tasks[] (so it can stay in flash, with app_tasks_len entries),
+// app_init() to init the stacks listed in the table, and an unrolled
+// dispatcher app_step() that calls every task directly (no function pointers,
+// so task functions declared static inline are inlined into it, while plain
+// static ones usually stay out of line since the table takes their address).
+// The table is what app_init() walks, and what a debugger or shell can list
+// the tasks from.
+//
+// Each pass of app_step() resumes every unfinished task once, in priority
+// order (0 first, ties in table order), and returns how many are still
+// running.  app_run() loops until they have all finished.
+//
+// Tasks are named after their function, so a function can only appear once.
+// A table holds at most 10 tasks, the same limit as the locals of
+// async_begin() (FOR_EACH in asyncc.h), and 11 to 20 fail to compile with
+// "ASYNC_TASK_TABLE holds at most 10 tasks".  Split bigger systems into
+// several tables, each with its own step(), or extend FOR_EACH.
+
+#ifndef ASYNC_TASK_PRIOS
+#define ASYNC_TASK_PRIOS 4
+#endif
+
+struct async_task_entry {
+    enum async (*fn)(uint8_t *s);
+    uint8_t *s;
+    uint16_t len;
+    uint8_t prio;
+};
+
+#define ATT_STACK(X) ATT_STACK_ X
+#define ATT_STACK_(fn, len, prio)                                   \
+    _Static_assert((prio) < ASYNC_TASK_PRIOS, #fn ": bad priority"); \
+    static uint8_t async_stack_##fn[len];                           \
+    static uint8_t async_live_##fn;
+
+#define ATT_ENTRY(X) ATT_ENTRY_ X
+#define ATT_ENTRY_(fn, len, prio) { fn, async_stack_##fn, len, prio },
+
+#define ATT_LIVE(X) ATT_LIVE_ X
+#define ATT_LIVE_(fn, len, prio) async_live_##fn = 1;
+
+#define ATT_RUN(X) ATT_RUN_ X
+#define ATT_RUN_(fn, len, prio)                                     \
+    if ((prio) == a_prio && async_live_##fn) {                      \
+        async_live_##fn = fn(async_stack_##fn) == ASYNC_CONT;       \
+        a_live += async_live_##fn;                                  \
+    }
+
+// Picks ATT_TABLE for up to 10 tasks and ATT_TOO_MANY for 11 to 20
+#define ASYNC_TASK_TABLE(name, ...)                                 \
+    ATT_PICK(__VA_ARGS__,                                           \
+        ATT_TOO_MANY, ATT_TOO_MANY, ATT_TOO_MANY, ATT_TOO_MANY,     \
+        ATT_TOO_MANY, ATT_TOO_MANY, ATT_TOO_MANY, ATT_TOO_MANY,     \
+        ATT_TOO_MANY, ATT_TOO_MANY, ATT_TABLE, ATT_TABLE, ATT_TABLE, \
+        ATT_TABLE, ATT_TABLE, ATT_TABLE, ATT_TABLE, ATT_TABLE,      \
+        ATT_TABLE, ATT_TABLE)(name, __VA_ARGS__)
+#define ATT_PICK(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, \
+        _13, _14, _15, _16, _17, _18, _19, _20, NAME, ...) NAME
+#define ATT_TOO_MANY(name, ...)                                     \
+    _Static_assert(0, "ASYNC_TASK_TABLE holds at most 10 tasks");
+
+#define ATT_TABLE(name, ...)                                        \
+    FOR_EACH(ATT_STACK, __VA_ARGS__)                                \
+    static const struct async_task_entry name##_tasks[] = {         \
+        FOR_EACH(ATT_ENTRY, __VA_ARGS__)                            \
+    };                                                              \
+    enum { name##_tasks_len =                                       \
+        sizeof(name##_tasks) / sizeof(name##_tasks[0]) };           \
+    static inline void name##_init(void)                            \
+    {                                                               \
+        for (uint8_t a_i = 0; a_i < name##_tasks_len; a_i++) {      \
+            async_init(name##_tasks[a_i].s, name##_tasks[a_i].len); \
+        }                                                           \
+        FOR_EACH(ATT_LIVE, __VA_ARGS__)                             \
+    }                                                               \
+    static inline uint8_t name##_step(void)                         \
+    {                                                               \
+        uint8_t a_live = 0;                                         \
+        for (uint8_t a_prio = 0; a_prio < ASYNC_TASK_PRIOS; a_prio++) { \
+            FOR_EACH(ATT_RUN, __VA_ARGS__)                          \
+        }                                                           \
+        return a_live;                                              \
+    }                                                               \
+    static inline void name##_run(void)                             \
+    {                                                               \
+        while (name##_step()) {                                     \
+        }                                                           \
+    }
+
+#endif // ASYNCC_TABLE_H
@@ -0,0 +1,256 @@
+// @file asyncc_timer.h
+// Timer service shared by several runtimes
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+#ifndef ASYNCC_TIMER_H
+#define ASYNCC_TIMER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include "asyncc_rt.h"
+
+// One timer service, driven by one tick source, for any number of runtimes
+// (each on its own thread or RTOS task):
+//
+//   struct async_timers timers;         // Shared
+//   struct async_inbox fast_ib, bg_ib;  // One per runtime
+//
+//   void tick_isr(void) { ASYNC_TICK(&timers, 1); }
+//
+//   enum async blink(uint8_t *s, void *arg)
+//   {
+//       async_begin(s);
+//       for (;;) {
+//           toggle_led();
+//           await_sleep(s, &fast_ib, 500);
+//       }
+//       async_end(s);
+//   }
+//
+// A sleeping task hands its timer to the service through a lock-free list and
+// parks.  The tick drains that list into a timing wheel (one slot per
+// millisecond, timers further out than the wheel simply go round again), and
+// delivers the expired ones to the inbox of the runtime they came from
+// (another lock-free list).  The runtime thread calls async_inbox_drain() to
+// wake the tasks, so the runtime itself is never touched from another thread.
+//
+// When a tick delivers to an empty inbox it calls the inbox's kick function,
+// so an idle runtime thread can block on a semaphore (or RTOS notification)
+// and still be woken in time.  Drain after every kick; a kick that arrives
+// while the runtime is busy is harmless.
+//
+// A sleep can also allow some slack, await_sleep_slack(s, ib, ms, slack), to
+// fire up to slack ms late.  The service then picks the roundest tick in the
+// window (the one with the most trailing zero bits), so timers whose windows
+// overlap tend to expire on the same tick and reach an idle runtime as one
+// kick instead of one each.  Periodic tasks with slightly different periods
+// and a slack of a few percent coalesce well.
+//
+// Timers live in the sleeping function's locals, so a sleep must run to
+// completion: don't sleep in a fork-join branch that may be abandoned, and
+// don't move or hibernate a sleeping task (see asyncc_reloc.h).
+
+#ifndef ASYNC_TIMER_SLOTS
+#define ASYNC_TIMER_SLOTS 64    // Wheel size, a power of two
+#endif
+
+struct async_inbox;
+
+struct async_timer {
+    struct async_timer *next;   // Link in whichever list holds the timer
+    struct async_inbox *inbox;  // Where it is delivered when it expires
+    struct async_task *task;
+    uint32_t due;               // Delay until the service takes it, then the
+                                // tick it expires on
+    uint32_t slack;             // How late it may fire
+    uint8_t fired;              // Only touched by the runtime thread
+};
+
+struct async_timers {
+    _Atomic(struct async_timer*) armed;     // Waiting to be sorted in
+    struct async_timer *wheel[ASYNC_TIMER_SLOTS];  // Tick thread only
+    _Atomic uint32_t now;                   // Milliseconds since init
+};
+
+struct async_inbox {
+    _Atomic(struct async_timer*) head;      // Expired, not yet woken
+    struct async_runtime *rt;
+    struct async_timers *timers;
+    void (*kick)(void *arg);                // Optional, called from the tick
+    void *arg;
+};
+
+static inline void async_timers_init(struct async_timers *tm)
+{
+    atomic_init(&tm->armed, NULL);
+    for (uint16_t i = 0; i < ASYNC_TIMER_SLOTS; i++) {
+        tm->wheel[i] = NULL;
+    }
+    atomic_init(&tm->now, 0);
+}
+
+static inline uint32_t async_timers_now(struct async_timers *tm)
+{
+    return atomic_load_explicit(&tm->now, memory_order_relaxed);
+}
+
+static inline void async_inbox_init(struct async_inbox *ib, struct async_runtime *rt,
+        struct async_timers *tm, void (*kick)(void *arg), void *arg)
+{
+    atomic_init(&ib->head, NULL);
+    ib->rt = rt;
+    ib->timers = tm;
+    ib->kick = kick;
+    ib->arg = arg;
+}
+
+// Push onto a lock-free list, returns the previous head.  Lists are only ever
+// emptied as a whole (atomic exchange), so there is no ABA problem.
+static inline struct async_timer *async_timer_push(_Atomic(struct async_timer*) *list,
+        struct async_timer *t)
+{
+    struct async_timer *head = atomic_load_explicit(list, memory_order_relaxed);
+    do {
+        t->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(list, &head, t,
+                memory_order_release, memory_order_relaxed));
+    return head;
+}
+
+static inline struct async_timer *async_timer_take(_Atomic(struct async_timer*) *list)
+{
+    return atomic_exchange_explicit(list, NULL, memory_order_acquire);
+}
+
+// Hand a timer for the current task of ib's runtime to the service.  It fires
+// ms milliseconds after the next tick at the earliest, and slack ms after that
+// at the latest.
+static inline void async_timer_arm(struct async_inbox *ib, struct async_timer *t,
+        uint32_t ms, uint32_t slack)
+{
+    t->inbox = ib;
+    t->task = ib->rt->current;
+    t->due = ms;
+    t->slack = slack;
+    t->fired = 0;
+    async_rt_count(ib->rt, ASYNC_M_TIMERS_ARMED, 1);
+    async_timer_push(&ib->timers->armed, t);
+}
+
+// The roundest tick from due to due + slack: keep the bits that the two have
+// in common, and of the rest only the highest
+static inline uint32_t async_timer_round(uint32_t due, uint32_t slack)
+{
+    uint32_t limit = due + slack;
+    if (!slack || limit < due) {
+        return due;
+    }
+    uint32_t mask = (1u << (31 - __builtin_clz(due ^ limit))) - 1;
+    return limit & ~mask;
+}
+
+// Advance the clock by ms and deliver every timer that is due.  Call it from
+// one place only (a timer ISR, or a thread), that is the only synchronization
+// the service needs.
+static inline void async_timer_tick(struct async_timers *tm, uint32_t ms)
+{
+    uint32_t now = async_timers_now(tm);
+    uint32_t end = now + ms;
+
+    struct async_timer *t = async_timer_take(&tm->armed);
+    while (t) {
+        struct async_timer *next = t->next;
+        t->due = async_timer_round(end + t->due, t->slack);
+        struct async_timer **slot = &tm->wheel[t->due & (ASYNC_TIMER_SLOTS - 1)];
+        t->next = *slot;
+        *slot = t;
+        t = next;
+    }
+
+    // Visit the slot of every millisecond that passed
+    while (now != end) {
+        now++;
+        struct async_timer **at = &tm->wheel[now & (ASYNC_TIMER_SLOTS - 1)];
+        while ((t = *at)) {
+            if ((int32_t)(t->due - now) > 0) {
+                at = &t->next;
+                continue;
+            }
+            *at = t->next;
+            struct async_inbox *ib = t->inbox;
+            if (!async_timer_push(&ib->head, t) && ib->kick) {
+                ib->kick(ib->arg);
+            }
+        }
+    }
+    atomic_store_explicit(&tm->now, end, memory_order_relaxed);
+}
+
+#define ASYNC_TICK(tm, ms) async_timer_tick(tm, ms)
+
+// Wake the tasks of every timer delivered to this inbox, in expiry order.
+// Call it from the runtime's own thread, between resumes.  Returns the number
+// of timers that fired.
+static inline uint32_t async_inbox_drain(struct async_inbox *ib)
+{
+    struct async_timer *t = async_timer_take(&ib->head);
+    struct async_timer *fifo = NULL;
+    while (t) {
+        struct async_timer *next = t->next;
+        t->next = fifo;
+        fifo = t;
+        t = next;
+    }
+
+    uint32_t n = 0;
+    for (t = fifo; t; t = t->next, n++) {
+        t->fired = 1;
+        async_wake(ib->rt, t->task);
+    }
+    async_rt_count(ib->rt, ASYNC_M_TIMERS_FIRED, n);
+    return n;
+}
+
+// Sleep for at least ms milliseconds (rounded up to the next tick), and at
+// most slack more.  This is a leaf, so the timer costs the awaiting function
+// no frame of its own.
+static inline enum async async_sleep_slack(uint8_t *s, struct async_inbox *ib,
+        uint32_t ms, uint32_t slack)
+{
+    async_inline_begin(s, struct async_timer t);
+    async_timer_arm(ib, &l->t, ms, slack);
+    await(l->t.fired || !async_park_on(ib->rt, "sleep"));
+    async_inline_end(s);
+}
+
+static inline enum async async_sleep(uint8_t *s, struct async_inbox *ib, uint32_t ms)
+{
+    return async_sleep_slack(s, ib, ms, 0);
+}
+
+#define await_sleep(s, ib, ms) await(async_sleep(s, ib, ms))
+#define await_sleep_slack(s, ib, ms, slack) \
+    await(async_sleep_slack(s, ib, ms, slack))
+
+#endif // ASYNCC_TIMER_H
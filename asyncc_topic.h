@@ -0,0 +1,199 @@
+// @file asyncc_topic.h
+// Publish/subscribe topics: a seqlocked ring read in place by parked subscribers
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+#ifndef ASYNCC_TOPIC_H
+#define ASYNCC_TOPIC_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "asyncc_sync.h"
+
+// A topic keeps the last few messages in a ring of fixed-size slots.  The
+// publisher writes a message straight into its slot, and every subscriber
+// reads it from there, so a message is written once however many tasks
+// read it.  Subscribers that have seen everything park on the topic, and a
+// publish wakes all of them in one pass:
+//
+//   static uint8_t imu_buf[ASYNC_TOPIC_BUF(8, sizeof(struct imu))];
+//   static struct async_topic imu;  // async_topic_init(&imu, &rt, imu_buf, 8,
+//                                   //     sizeof(struct imu))
+//
+//   enum async filter(uint8_t *s, void *arg)
+//   {
+//       async_begin(s, uint32_t last, uint32_t lost);
+//       l->last = async_topic_seq(&imu);        // Only new messages
+//       for (;;) {
+//           await_topic(s, &imu, &l->last);
+//           const struct imu *m;
+//           while ((m = async_topic_next(&imu, &l->last, &l->lost, NULL))) {
+//               update(m);
+//           }
+//       }
+//       async_end(s);
+//   }
+//
+// The publisher never waits for subscribers.  One that falls more than the
+// ring size behind skips to the oldest message still there, and lost counts
+// the ones it missed.
+//
+// Every slot is a seqlock: its sequence number is odd while the slot is being
+// written, and twice the message's number once it is complete.  That makes
+// it safe to hold on to a message across an await, or to read the topic from
+// another thread without parking (publish on the runtime's own thread): read
+// the message in place, then check async_topic_valid() before trusting what
+// was read.
+
+struct async_topic_slot {
+    _Atomic uint32_t seq;       // 2n once message n is complete, odd while
+    uint32_t len;               // it is being written
+    _Alignas(8) uint8_t data[];
+};
+
+#define ASYNC_TOPIC_SLOT(size) \
+    ((sizeof(struct async_topic_slot) + (size) + 7) & ~(size_t)7)
+#define ASYNC_TOPIC_BUF(slots, size)    ((slots) * ASYNC_TOPIC_SLOT(size))
+
+struct async_topic {
+    struct async_runtime *rt;
+    uint8_t *ring;
+    uint32_t stride;            // ASYNC_TOPIC_SLOT(size)
+    uint32_t size;              // Max message length
+    uint32_t slots;             // A power of two
+    _Atomic uint32_t seq;       // Messages published so far
+    struct async_waitq waiters;
+};
+
+// Init a topic over buf (ASYNC_TOPIC_BUF(slots, size) bytes, 8-byte aligned)
+static inline void async_topic_init(struct async_topic *t, struct async_runtime *rt,
+        uint8_t *buf, uint32_t slots, uint32_t size)
+{
+    t->rt = rt;
+    t->ring = buf;
+    t->stride = ASYNC_TOPIC_SLOT(size);
+    t->size = size;
+    t->slots = slots;
+    atomic_init(&t->seq, 0);
+    async_waitq_init(&t->waiters);
+    for (uint32_t i = 0; i < slots; i++) {
+        struct async_topic_slot *slot = (struct async_topic_slot*)(buf + i * t->stride);
+        atomic_init(&slot->seq, 0);
+        slot->len = 0;
+    }
+}
+
+static inline uint32_t async_topic_seq(struct async_topic *t)
+{
+    return atomic_load_explicit(&t->seq, memory_order_acquire);
+}
+
+static inline struct async_topic_slot *async_topic_slot(struct async_topic *t, uint32_t n)
+{
+    return (struct async_topic_slot*)(t->ring + (n & (t->slots - 1)) * t->stride);
+}
+
+// Slot for the next message, write up to size bytes to it and then call
+// async_topic_publish()
+static inline void *async_topic_claim(struct async_topic *t)
+{
+    uint32_t n = atomic_load_explicit(&t->seq, memory_order_relaxed) + 1;
+    struct async_topic_slot *slot = async_topic_slot(t, n);
+    atomic_store_explicit(&slot->seq, 2 * n - 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return slot->data;
+}
+
+// Publish the claimed slot (len bytes) and wake every subscriber
+static inline void async_topic_publish(struct async_topic *t, uint32_t len)
+{
+    uint32_t n = atomic_load_explicit(&t->seq, memory_order_relaxed) + 1;
+    struct async_topic_slot *slot = async_topic_slot(t, n);
+    slot->len = len;
+    atomic_store_explicit(&slot->seq, 2 * n, memory_order_release);
+    atomic_store_explicit(&t->seq, n, memory_order_release);
+    async_waitq_wake_all(&t->waiters, t->rt);
+}
+
+static inline void async_topic_put(struct async_topic *t, const void *msg, uint32_t len)
+{
+    memcpy(async_topic_claim(t), msg, len);
+    async_topic_publish(t, len);
+}
+
+// Whether message n is still in its slot (check it after reading in place)
+static inline int async_topic_valid(struct async_topic *t, uint32_t n)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&async_topic_slot(t, n)->seq, memory_order_relaxed) == 2 * n;
+}
+
+// The message after *last, or NULL if there is none yet.  On success *last
+// is its number, *lost (if not NULL) grows by the messages that were skipped
+// because they were overwritten, and *len (if not NULL) is its length.
+static inline const void *async_topic_next(struct async_topic *t, uint32_t *last,
+        uint32_t *lost, uint32_t *len)
+{
+    for (;;) {
+        uint32_t head = async_topic_seq(t);
+        uint32_t n = *last + 1;
+        if (head == *last) {
+            return NULL;
+        }
+        if (head - *last > t->slots) {
+            n = head - t->slots + 1;
+        }
+        struct async_topic_slot *slot = async_topic_slot(t, n);
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != 2 * n) {
+            // Overwritten since head was read (publisher on another thread)
+            if (lost) {
+                *lost += n - *last;
+            }
+            *last = n;
+            continue;
+        }
+        if (lost) {
+            *lost += n - *last - 1;
+        }
+        *last = n;
+        if (len) {
+            *len = slot->len;
+        }
+        return slot->data;
+    }
+}
+
+// Park until there is a message after *last (a leaf)
+static inline enum async async_topic_wait(uint8_t *s, struct async_topic *t, uint32_t *last)
+{
+    async_inline_begin(s, struct async_waiter w);
+    if (async_topic_seq(t) == *last) {
+        async_waitq_push(&t->waiters, t->rt, &l->w);
+        await(l->w.woken || !async_park_on(t->rt, "topic"));
+    }
+    async_inline_end(s);
+}
+
+#define await_topic(s, t, last) await(async_topic_wait(s, t, last))
+
+#endif // ASYNCC_TOPIC_H
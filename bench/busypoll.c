@@ -0,0 +1,146 @@
+// @file busypoll.c
+// Wakeup latency of a socket read when the idle loop blocks, spins, or both
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Usage: busypoll [messages] [us between messages]
+//
+// A sender thread writes its clock to a datagram socket every 100 us (20000
+// times by default), and a task on the runtime awaits each one and records
+// how long after the send it woke up.  The idle loop runs in three modes:
+// blocking in epoll_wait() right away, spinning for up to 2000 empty polls
+// before blocking, and spinning forever.  Prints the latency percentiles and
+// the CPU time the runtime thread used per second of wall time.
+//
+// The sender needs a core of its own to see what spinning buys, on a single
+// core the spinning loop just delays it.
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "../asyncc_net.h"
+
+#define STACK_LEN   64
+
+static struct async_runtime rt;
+static struct async_net net;
+static struct async_task task;
+static uint8_t stack[STACK_LEN];
+static int fds[2];
+static uint32_t count, gap_us;
+static uint32_t *lat;
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    fprintf(stderr, "stack overflow: %p needs %d more bytes\n", s, locals_size);
+    exit(1);
+}
+
+static uint64_t clock_ns(clockid_t id)
+{
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void *sender(void *arg)
+{
+    (void)arg;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (uint32_t i = 0; i < count; i++) {
+        next.tv_nsec += gap_us * 1000;
+        while (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        uint64_t t = clock_ns(CLOCK_MONOTONIC);
+        if (write(fds[1], &t, sizeof(t)) < 0) {
+            perror("write");
+        }
+    }
+    return NULL;
+}
+
+enum async receiver(uint8_t *s, void *arg)
+{
+    (void)arg;
+    async_begin(s, uint32_t i, long n, uint64_t sent);
+    for (l->i = 0; l->i < count; l->i++) {
+        await_recv(&net, fds[0], &l->sent, sizeof(l->sent), l->n);
+        lat[l->i] = (uint32_t)(clock_ns(CLOCK_MONOTONIC) - l->sent);
+    }
+    async_end(s);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(const char *name, uint32_t spin)
+{
+    async_rt_init(&rt);
+    async_net_init(&net, &rt);
+    async_net_spin(&net, spin, 64);
+    socketpair(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds);
+    // The sender blocks when the receiver falls behind, so nothing is dropped
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) & ~O_NONBLOCK);
+    async_sched(&rt, &task, receiver, NULL, stack, STACK_LEN);
+
+    pthread_t th;
+    uint64_t wall = clock_ns(CLOCK_MONOTONIC), cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    pthread_create(&th, NULL, sender, NULL);
+    async_net_run(&net);
+    pthread_join(th, NULL);
+    wall = clock_ns(CLOCK_MONOTONIC) - wall;
+    cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+
+    qsort(lat, count, sizeof(*lat), cmp_u32);
+    printf("%-10s wakeup p50 %6.1f us  p99 %7.1f us  p99.9 %7.1f us, "
+            "cpu %3.0f%%, %u waits spun, %u blocked\n", name,
+            lat[count / 2] / 1e3, lat[count * 99 / 100] / 1e3,
+            lat[count * 999 / 1000] / 1e3, 100.0 * cpu / wall, net.spun, net.blocked);
+    close(fds[0]);
+    close(fds[1]);
+    async_net_close(&net);
+}
+
+int main(int argc, char **argv)
+{
+    count = argc > 1 ? (uint32_t)atoi(argv[1]) : 20000;
+    gap_us = argc > 2 ? (uint32_t)atoi(argv[2]) : 100;
+    lat = malloc(count * sizeof(*lat));
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        printf("(only one core, spinning competes with the sender)\n");
+    }
+
+    run("blocking:", 0);
+    run("adaptive:", 2000);
+    run("spinning:", ASYNC_SPIN_FOREVER);
+    return 0;
+}
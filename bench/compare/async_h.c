@@ -0,0 +1,182 @@
+// @file async_h.c
+// The comparison workloads on async.h
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+// Needs async.h from Sandro Magi on the include path, and is left out of the
+// results without it.  It shares its macro names with asyncc.h, hence a file
+// of its own.  Locals go in the state struct of each function, so a chain of
+// nested awaits needs a struct per level.  Completion is read back with
+// async_done() rather than from return values.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "compare.h"
+
+#if __has_include("async.h")
+#include "async.h"
+
+CMP_SECTION(async_h)
+
+// Resume a child and check whether it has finished
+#define finished(call, st)  ((call), async_done(st))
+
+struct loop {
+    async_state;
+    uint32_t i;
+};
+
+static uint32_t rounds;
+static uint8_t idle_go;
+
+CMP_CODE(async_h) static async yielder(struct loop *t)
+{
+    async_begin(t);
+    for (t->i = 0; t->i < rounds; t->i++) {
+        async_yield;
+    }
+    async_end;
+}
+
+// One struct loop per level of the chain
+CMP_CODE(async_h) static async nest(struct loop *t, uint8_t depth)
+{
+    async_begin(t);
+    if (depth) {
+        async_init(&t[1]);
+        await(finished(nest(&t[1], depth - 1), &t[1]));
+    } else {
+        for (t->i = 0; t->i < CMP_YIELDS; t->i++) {
+            async_yield;
+        }
+    }
+    async_end;
+}
+
+CMP_CODE(async_h) static async nester(struct loop *t)
+{
+    async_begin(t);
+    for (t->i = 0; t->i < rounds / CMP_YIELDS; t->i++) {
+        async_init(&t[1]);
+        await(finished(nest(&t[1], CMP_DEPTH), &t[1]));
+    }
+    async_end;
+}
+
+CMP_CODE(async_h) static async kid(struct loop *t)
+{
+    async_begin(t);
+    for (t->i = 0; t->i < CMP_YIELDS; t->i++) {
+        async_yield;
+    }
+    async_end;
+}
+
+struct fork {
+    async_state;
+    uint32_t i;
+    struct loop kids[2];
+};
+
+CMP_CODE(async_h) static async forker(struct fork *t)
+{
+    async_begin(t);
+    for (t->i = 0; t->i < rounds / CMP_YIELDS; t->i++) {
+        async_init(&t->kids[0]);
+        async_init(&t->kids[1]);
+        await(finished(kid(&t->kids[0]), &t->kids[0]) &
+                finished(kid(&t->kids[1]), &t->kids[1]));
+    }
+    async_end;
+}
+
+CMP_CODE(async_h) static async idler(struct async *t)
+{
+    async_begin(t);
+    await(idle_go);
+    async_end;
+}
+
+void cmp_async_h(struct cmp_result *r, const struct cmp_params *p)
+{
+    static struct loop a[CMP_DEPTH + 2], b;
+    static struct fork f;
+    uint64_t n = 0, start;
+    rounds = p->rounds;
+    r->name = "async.h";
+
+    async_init(&a[0]);
+    async_init(&b);
+    start = cmp_now_ns();
+    for (int live = 3; live; n++) {
+        if ((live & 1) && finished(yielder(&a[0]), &a[0])) {
+            live &= ~1;
+        }
+        if ((live & 2) && finished(yielder(&b), &b)) {
+            live &= ~2;
+        }
+    }
+    r->yield_ns = cmp_ns_since(start, 2 * n);
+
+    async_init(&a[0]);
+    start = cmp_now_ns();
+    for (n = 1; !finished(nester(a), &a[0]); n++) {
+    }
+    r->nested_ns = cmp_ns_since(start, n);
+
+    async_init(&f);
+    start = cmp_now_ns();
+    while (!finished(forker(&f), &f)) {
+    }
+    r->fork_ns = cmp_ns_since(start, rounds / CMP_YIELDS);
+
+    struct async *idle = calloc(p->idle, sizeof(*idle));
+    idle_go = 0;
+    for (uint32_t i = 0; i < p->idle; i++) {
+        async_init(&idle[i]);
+    }
+    start = cmp_now_ns();
+    for (uint32_t pass = 0; pass < p->passes; pass++) {
+        for (uint32_t i = 0; i < p->idle; i++) {
+            idler(&idle[i]);
+        }
+    }
+    r->idle_ns = cmp_ns_since(start, (uint64_t)p->passes * p->idle);
+    idle_go = 1;
+    for (uint32_t i = 0; i < p->idle; i++) {
+        if (!finished(idler(&idle[i]), &idle[i])) {
+            fprintf(stderr, "async.h: idle task %u didn't finish\n", i);
+            exit(1);
+        }
+    }
+    free(idle);
+    r->idle_bytes = sizeof(struct async);
+    r->code_bytes = CMP_CODE_SIZE(async_h);
+}
+#else
+void cmp_async_h(struct cmp_result *r, const struct cmp_params *p)
+{
+    (void)p;
+    r->name = "async.h";
+    r->missing = "async.h not found";
+}
+#endif
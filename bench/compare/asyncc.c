@@ -0,0 +1,170 @@
+// @file asyncc.c
+// The comparison workloads on asyncc
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+// await_call() starts every child, as users write it.  The fork's second
+// child runs on a sub-stack in the parent's frame, initialized every round
+// (as the other C libraries initialize their children's state).
+//
+// An idle task's state is its stack: the header (ASYNC_HDR_SIZE, 4 bytes, or
+// 6 with ASYNC_TRACK_EXTENT) plus one frame with its spot, sized exactly.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../asyncc.h"
+#include "compare.h"
+
+#define STACK_LEN   128
+#define KID_LEN     (ASYNC_HDR_SIZE + 16)
+
+// The frame of a function without locals
+struct idle_frame {
+    uint16_t spot A_TRACE_FIELDS;
+};
+#define IDLE_LEN    (ASYNC_HDR_SIZE + sizeof(struct idle_frame))
+
+CMP_SECTION(asyncc)
+
+static uint32_t rounds;
+static uint8_t idle_go;
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    fprintf(stderr, "stack overflow: %p needs %d more bytes\n", s, locals_size);
+    exit(1);
+}
+
+CMP_CODE(asyncc) static enum async yielder(uint8_t *s)
+{
+    async_begin(s, uint32_t i);
+    for (l->i = 0; l->i < rounds; l->i++) {
+        async_yield;
+    }
+    async_end(s);
+}
+
+CMP_CODE(asyncc) static enum async nest(uint8_t *s, uint8_t depth)
+{
+    async_begin(s, uint8_t i);
+    if (depth) {
+        await_call(nest(s, depth - 1));
+    } else {
+        for (l->i = 0; l->i < CMP_YIELDS; l->i++) {
+            async_yield;
+        }
+    }
+    async_end(s);
+}
+
+CMP_CODE(asyncc) static enum async nester(uint8_t *s)
+{
+    async_begin(s, uint32_t i);
+    for (l->i = 0; l->i < rounds / CMP_YIELDS; l->i++) {
+        await_call(nest(s, CMP_DEPTH));
+    }
+    async_end(s);
+}
+
+CMP_CODE(asyncc) static enum async kid(uint8_t *s)
+{
+    async_begin(s, uint8_t i);
+    for (l->i = 0; l->i < CMP_YIELDS; l->i++) {
+        async_yield;
+    }
+    async_end(s);
+}
+
+CMP_CODE(asyncc) static enum async forker(uint8_t *s)
+{
+    async_begin(s, uint32_t i, uint8_t s1[KID_LEN]);
+    for (l->i = 0; l->i < rounds / CMP_YIELDS; l->i++) {
+        async_init(l->s1, KID_LEN);
+        await_call(kid(s) & kid(l->s1));
+    }
+    async_end(s);
+}
+
+CMP_CODE(asyncc) static enum async idler(uint8_t *s)
+{
+    async_begin(s);
+    await(idle_go);
+    async_end(s);
+}
+
+void cmp_asyncc(struct cmp_result *r, const struct cmp_params *p)
+{
+    static uint8_t a[STACK_LEN], b[STACK_LEN];
+    uint64_t n = 0, start;
+    rounds = p->rounds;
+    r->name = "asyncc";
+
+    async_init(a, STACK_LEN);
+    async_init(b, STACK_LEN);
+    start = cmp_now_ns();
+    for (int live = 3; live; n++) {
+        if ((live & 1) && yielder(a) == ASYNC_DONE) {
+            live &= ~1;
+        }
+        if ((live & 2) && yielder(b) == ASYNC_DONE) {
+            live &= ~2;
+        }
+    }
+    r->yield_ns = cmp_ns_since(start, 2 * n);
+
+    async_init(a, STACK_LEN);
+    start = cmp_now_ns();
+    for (n = 1; nester(a) != ASYNC_DONE; n++) {
+    }
+    r->nested_ns = cmp_ns_since(start, n);
+
+    async_init(a, STACK_LEN);
+    start = cmp_now_ns();
+    while (forker(a) != ASYNC_DONE) {
+    }
+    r->fork_ns = cmp_ns_since(start, rounds / CMP_YIELDS);
+
+    uint8_t (*idle)[IDLE_LEN] = calloc(p->idle, IDLE_LEN);
+    idle_go = 0;
+    for (uint32_t i = 0; i < p->idle; i++) {
+        async_init(idle[i], IDLE_LEN);
+    }
+    start = cmp_now_ns();
+    for (uint32_t pass = 0; pass < p->passes; pass++) {
+        for (uint32_t i = 0; i < p->idle; i++) {
+            idler(idle[i]);
+        }
+    }
+    r->idle_ns = cmp_ns_since(start, (uint64_t)p->passes * p->idle);
+    idle_go = 1;
+    for (uint32_t i = 0; i < p->idle; i++) {
+        if (idler(idle[i]) != ASYNC_DONE) {
+            fprintf(stderr, "asyncc: idle task %u didn't finish\n", i);
+            exit(1);
+        }
+    }
+    free(idle);
+    r->idle_bytes = IDLE_LEN;
+    r->code_bytes = CMP_CODE_SIZE(asyncc);
+}
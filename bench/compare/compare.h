@@ -0,0 +1,100 @@
+// @file compare.h
+// Workloads and results shared by the comparison benchmark
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+#ifndef COMPARE_H
+#define COMPARE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Every library runs the same four workloads, each driven by a plain loop
+// that calls the top-level coroutines directly (no runtime or scheduler):
+//
+//   yield:  two tasks yield rounds times each, resumed alternately
+//   nested: a task awaits a chain of CMP_DEPTH nested coroutines rounds /
+//           CMP_YIELDS times, the innermost yields CMP_YIELDS times
+//   fork:   a task forks two children that yield CMP_YIELDS times each and
+//           joins them, rounds / CMP_YIELDS times
+//   idle:   idle tasks wait for a flag that stays clear for passes resumes
+//           of every task, then is set so they all finish
+//
+// The workload functions of each library are put in a linker section of
+// their own (cmp_code_asyncc, cmp_code_pt, ...), so their code size can be
+// read from the section bounds.  Helpers that the compiler inlines into them
+// count, ones it doesn't (libc, operator new) don't.
+
+#define CMP_DEPTH   8
+#define CMP_YIELDS  4
+
+#define CMP_CODE(lib)   __attribute__((section("cmp_code_" #lib), noinline))
+#define CMP_SECTION(lib)                                            \
+    extern char __start_cmp_code_##lib[] __attribute__((weak));     \
+    extern char __stop_cmp_code_##lib[] __attribute__((weak));
+#define CMP_CODE_SIZE(lib)                                          \
+    ((size_t)(__stop_cmp_code_##lib - __start_cmp_code_##lib))
+
+struct cmp_params {
+    uint32_t rounds;
+    uint32_t idle;          // Idle tasks
+    uint32_t passes;        // Resumes of each idle task before the flag is set
+};
+
+struct cmp_result {
+    const char *name;
+    const char *missing;    // Why it didn't run (NULL if it did)
+    double yield_ns;        // Per switch
+    double nested_ns;       // Per resume of the outer task
+    double fork_ns;         // Per fork and join
+    double idle_ns;         // Per resume of an idle task
+    size_t idle_bytes;      // State of an idle task
+    size_t code_bytes;      // Workload functions
+};
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void cmp_asyncc(struct cmp_result *r, const struct cmp_params *p);
+void cmp_pt(struct cmp_result *r, const struct cmp_params *p);
+void cmp_async_h(struct cmp_result *r, const struct cmp_params *p);
+void cmp_coro(struct cmp_result *r, const struct cmp_params *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+static inline uint64_t cmp_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static inline double cmp_ns_since(uint64_t start, uint64_t n)
+{
+    return (double)(cmp_now_ns() - start) / (n ? n : 1);
+}
+
+#endif // COMPARE_H
@@ -0,0 +1,266 @@
+// @file coro.cpp
+// The comparison workloads on C++20 coroutines
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+// Task is a minimal lazy coroutine type.  Awaiting a Task runs it by
+// symmetric transfer, and the innermost running frame of each top-level task
+// is tracked, so resuming a nested chain jumps straight to the frame that
+// yielded (no walk down the chain as in the stackless C libraries).  Every
+// call allocates a frame on the heap, unless the compiler elides it.  There
+// is no standard when_all(), so the fork resumes both children itself.
+//
+// An idle task's state is its frame plus the Task (handle and innermost
+// frame).  Built without coroutine support, it's left out of the results.
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "compare.h"
+
+#if __has_include(<coroutine>) && __cplusplus >= 202002L
+#include <coroutine>
+#include <exception>
+#include <new>
+
+CMP_SECTION(coro)
+
+static size_t frame_bytes;
+
+struct Task {
+    struct promise_type {
+        std::coroutine_handle<> parent;
+        std::coroutine_handle<> *leaf = nullptr;    // Innermost of the chain
+
+        static void *operator new(size_t n)
+        {
+            frame_bytes += n;
+            return ::operator new(n);
+        }
+        static void operator delete(void *p, size_t n)
+        {
+            frame_bytes -= n;
+            ::operator delete(p);
+        }
+
+        Task get_return_object()
+        {
+            return Task(
+                    std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        struct Final {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(
+                    std::coroutine_handle<promise_type> h) noexcept
+            {
+                promise_type &p = h.promise();
+                if (!p.parent) {
+                    return std::noop_coroutine();
+                }
+                *p.leaf = p.parent;
+                return p.parent;
+            }
+            void await_resume() noexcept {}
+        };
+        Final final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> h;
+    std::coroutine_handle<> leaf;
+
+    explicit Task(std::coroutine_handle<promise_type> h) : h(h) {}
+    Task(Task &&t) noexcept : h(t.h), leaf(t.leaf) { t.h = nullptr; }
+    Task &operator=(Task &&t) noexcept
+    {
+        std::swap(h, t.h);
+        std::swap(leaf, t.leaf);
+        return *this;
+    }
+    ~Task()
+    {
+        if (h) {
+            h.destroy();
+        }
+    }
+
+    // Make this a top-level task (once it has its final address)
+    void start()
+    {
+        leaf = h;
+        h.promise().leaf = &leaf;
+    }
+
+    // Resume it once, and tell whether it has finished
+    bool step()
+    {
+        if (!h.done()) {
+            leaf.resume();
+        }
+        return h.done();
+    }
+
+    // Awaiting a Task from another one
+    bool await_ready() noexcept { return false; }
+    template <class P>
+    std::coroutine_handle<> await_suspend(
+            std::coroutine_handle<P> parent) noexcept
+    {
+        promise_type &p = h.promise();
+        p.parent = parent;
+        p.leaf = parent.promise().leaf;
+        *p.leaf = h;
+        return h;
+    }
+    void await_resume() noexcept {}
+};
+
+static uint32_t rounds;
+static bool idle_go;
+
+CMP_CODE(coro) static Task yielder()
+{
+    for (uint32_t i = 0; i < rounds; i++) {
+        co_await std::suspend_always{};
+    }
+}
+
+CMP_CODE(coro) static Task nest(uint8_t depth)
+{
+    if (depth) {
+        co_await nest(depth - 1);
+    } else {
+        for (int i = 0; i < CMP_YIELDS; i++) {
+            co_await std::suspend_always{};
+        }
+    }
+}
+
+CMP_CODE(coro) static Task nester()
+{
+    for (uint32_t i = 0; i < rounds / CMP_YIELDS; i++) {
+        co_await nest(CMP_DEPTH);
+    }
+}
+
+CMP_CODE(coro) static Task kid()
+{
+    for (int i = 0; i < CMP_YIELDS; i++) {
+        co_await std::suspend_always{};
+    }
+}
+
+CMP_CODE(coro) static Task forker()
+{
+    for (uint32_t i = 0; i < rounds / CMP_YIELDS; i++) {
+        Task a = kid(), b = kid();
+        a.start();
+        b.start();
+        while (!(a.step() & b.step())) {
+            co_await std::suspend_always{};
+        }
+    }
+}
+
+CMP_CODE(coro) static Task idler()
+{
+    while (!idle_go) {
+        co_await std::suspend_always{};
+    }
+}
+
+extern "C" void cmp_coro(struct cmp_result *r, const struct cmp_params *p)
+{
+    uint64_t n = 0, start;
+    rounds = p->rounds;
+    r->name = "C++20 coroutines";
+
+    {
+        Task a = yielder(), b = yielder();
+        a.start();
+        b.start();
+        start = cmp_now_ns();
+        for (int live = 3; live; n++) {
+            if ((live & 1) && a.step()) {
+                live &= ~1;
+            }
+            if ((live & 2) && b.step()) {
+                live &= ~2;
+            }
+        }
+        r->yield_ns = cmp_ns_since(start, 2 * n);
+    }
+
+    {
+        Task a = nester();
+        a.start();
+        start = cmp_now_ns();
+        for (n = 1; !a.step(); n++) {
+        }
+        r->nested_ns = cmp_ns_since(start, n);
+    }
+
+    {
+        Task a = forker();
+        a.start();
+        start = cmp_now_ns();
+        while (!a.step()) {
+        }
+        r->fork_ns = cmp_ns_since(start, rounds / CMP_YIELDS);
+    }
+
+    std::vector<Task> idle;
+    idle.reserve(p->idle);
+    idle_go = false;
+    size_t before = frame_bytes;
+    for (uint32_t i = 0; i < p->idle; i++) {
+        idle.push_back(idler());
+        idle.back().start();
+    }
+    r->idle_bytes = (frame_bytes - before) / (p->idle ? p->idle : 1) +
+            sizeof(Task);
+    start = cmp_now_ns();
+    for (uint32_t pass = 0; pass < p->passes; pass++) {
+        for (Task &t : idle) {
+            t.step();
+        }
+    }
+    r->idle_ns = cmp_ns_since(start, (uint64_t)p->passes * p->idle);
+    idle_go = true;
+    for (uint32_t i = 0; i < p->idle; i++) {
+        if (!idle[i].step()) {
+            fprintf(stderr, "coro: idle task %u didn't finish\n", i);
+            exit(1);
+        }
+    }
+    r->code_bytes = CMP_CODE_SIZE(coro);
+}
+#else
+extern "C" void cmp_coro(struct cmp_result *r, const struct cmp_params *p)
+{
+    (void)p;
+    r->name = "C++20 coroutines";
+    r->missing = "no C++20 coroutine support";
+}
+#endif
@@ -0,0 +1,77 @@
+// @file main.c
+// Compare asyncc with Protothreads, async.h, and C++20 coroutines
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+// Usage: compare [rounds] [idle tasks] [idle passes]
+//
+// Runs the same workloads (see compare.h) on each library and prints a
+// table: ns per switch of two yielding tasks, ns per resume of a task
+// awaiting CMP_DEPTH nested coroutines, ns per fork and join of two
+// children, ns per resume of an idle task (10000 of them by default), the
+// bytes of state per idle task, and the code size of the workloads.
+//
+// Each library is built in a file of its own (asyncc.h and async.h use the
+// same macro names).  Protothreads and async.h aren't part of asyncc, so put
+// pt.h (with its lc*.h) and async.h on the include path, or they are
+// reported as missing:
+//
+//   cc -O2 -c main.c asyncc.c
+//   cc -O2 -I path/to/pt -c pt.c
+//   cc -O2 -I path/to/async.h -c async_h.c
+//   c++ -std=c++20 -O2 -c coro.cpp
+//   c++ -o compare main.o asyncc.o pt.o async_h.o coro.o
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "compare.h"
+
+int main(int argc, char **argv)
+{
+    struct cmp_params p = {
+        .rounds = argc > 1 ? (uint32_t)atoi(argv[1]) : 4000000,
+        .idle = argc > 2 ? (uint32_t)atoi(argv[2]) : 10000,
+        .passes = argc > 3 ? (uint32_t)atoi(argv[3]) : 100,
+    };
+    void (*libs[])(struct cmp_result *r, const struct cmp_params *p) = {
+        cmp_asyncc, cmp_pt, cmp_async_h, cmp_coro,
+    };
+
+    printf("%u rounds, %u idle tasks resumed %u times, nested %d deep\n\n",
+            p.rounds, p.idle, p.passes, CMP_DEPTH);
+    printf("%-18s %9s %9s %9s %9s %11s %10s\n", "", "yield", "nested",
+            "fork", "idle", "idle task", "code");
+    printf("%-18s %9s %9s %9s %9s %11s %10s\n", "", "ns/switch", "ns/resume",
+            "ns/join", "ns/resume", "bytes", "bytes");
+    for (size_t i = 0; i < sizeof(libs) / sizeof(libs[0]); i++) {
+        struct cmp_result r = { 0 };
+        libs[i](&r, &p);
+        if (r.missing) {
+            printf("%-18s (%s)\n", r.name, r.missing);
+            continue;
+        }
+        printf("%-18s %9.2f %9.2f %9.2f %9.2f %11zu %10zu\n", r.name,
+                r.yield_ns, r.nested_ns, r.fork_ns, r.idle_ns, r.idle_bytes,
+                r.code_bytes);
+    }
+    return 0;
+}
@@ -0,0 +1,180 @@
+// @file pt.c
+// The comparison workloads on Protothreads
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+//
+// Needs pt.h from Adam Dunkels' Protothreads on the include path, and is
+// left out of the results without it.  Protothreads have no locals, so the
+// loop counters live in structs around each struct pt (the usual idiom), and
+// a protothread restarts when it is called after it ended, so the fork keeps
+// its own done flags.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "compare.h"
+
+#if __has_include("pt.h")
+#include "pt.h"
+
+CMP_SECTION(pt)
+
+struct pt_loop {
+    struct pt pt;
+    uint32_t i;
+};
+
+static uint32_t rounds;
+static uint8_t idle_go;
+
+CMP_CODE(pt) static PT_THREAD(yielder(struct pt_loop *t))
+{
+    PT_BEGIN(&t->pt);
+    for (t->i = 0; t->i < rounds; t->i++) {
+        PT_YIELD(&t->pt);
+    }
+    PT_END(&t->pt);
+}
+
+// One pt_loop per level of the chain
+CMP_CODE(pt) static PT_THREAD(nest(struct pt_loop *t, uint8_t depth))
+{
+    PT_BEGIN(&t->pt);
+    if (depth) {
+        PT_SPAWN(&t->pt, &t[1].pt, nest(&t[1], depth - 1));
+    } else {
+        for (t->i = 0; t->i < CMP_YIELDS; t->i++) {
+            PT_YIELD(&t->pt);
+        }
+    }
+    PT_END(&t->pt);
+}
+
+CMP_CODE(pt) static PT_THREAD(nester(struct pt_loop *t))
+{
+    PT_BEGIN(&t->pt);
+    for (t->i = 0; t->i < rounds / CMP_YIELDS; t->i++) {
+        PT_SPAWN(&t->pt, &t[1].pt, nest(&t[1], CMP_DEPTH));
+    }
+    PT_END(&t->pt);
+}
+
+CMP_CODE(pt) static PT_THREAD(kid(struct pt_loop *t))
+{
+    PT_BEGIN(&t->pt);
+    for (t->i = 0; t->i < CMP_YIELDS; t->i++) {
+        PT_YIELD(&t->pt);
+    }
+    PT_END(&t->pt);
+}
+
+struct pt_fork {
+    struct pt pt;
+    uint32_t i;
+    uint8_t done[2];
+    struct pt_loop kids[2];
+};
+
+CMP_CODE(pt) static PT_THREAD(forker(struct pt_fork *t))
+{
+    PT_BEGIN(&t->pt);
+    for (t->i = 0; t->i < rounds / CMP_YIELDS; t->i++) {
+        PT_INIT(&t->kids[0].pt);
+        PT_INIT(&t->kids[1].pt);
+        t->done[0] = t->done[1] = 0;
+        PT_WAIT_UNTIL(&t->pt,
+                (t->done[0] = t->done[0] || !PT_SCHEDULE(kid(&t->kids[0]))) &
+                (t->done[1] = t->done[1] || !PT_SCHEDULE(kid(&t->kids[1]))));
+    }
+    PT_END(&t->pt);
+}
+
+CMP_CODE(pt) static PT_THREAD(idler(struct pt *pt))
+{
+    PT_BEGIN(pt);
+    PT_WAIT_UNTIL(pt, idle_go);
+    PT_END(pt);
+}
+
+void cmp_pt(struct cmp_result *r, const struct cmp_params *p)
+{
+    static struct pt_loop a[CMP_DEPTH + 2], b;
+    static struct pt_fork f;
+    uint64_t n = 0, start;
+    rounds = p->rounds;
+    r->name = "Protothreads";
+
+    PT_INIT(&a[0].pt);
+    PT_INIT(&b.pt);
+    start = cmp_now_ns();
+    for (int live = 3; live; n++) {
+        if ((live & 1) && !PT_SCHEDULE(yielder(&a[0]))) {
+            live &= ~1;
+        }
+        if ((live & 2) && !PT_SCHEDULE(yielder(&b))) {
+            live &= ~2;
+        }
+    }
+    r->yield_ns = cmp_ns_since(start, 2 * n);
+
+    PT_INIT(&a[0].pt);
+    start = cmp_now_ns();
+    for (n = 1; PT_SCHEDULE(nester(a)); n++) {
+    }
+    r->nested_ns = cmp_ns_since(start, n);
+
+    PT_INIT(&f.pt);
+    start = cmp_now_ns();
+    while (PT_SCHEDULE(forker(&f))) {
+    }
+    r->fork_ns = cmp_ns_since(start, rounds / CMP_YIELDS);
+
+    struct pt *idle = calloc(p->idle, sizeof(*idle));
+    idle_go = 0;
+    for (uint32_t i = 0; i < p->idle; i++) {
+        PT_INIT(&idle[i]);
+    }
+    start = cmp_now_ns();
+    for (uint32_t pass = 0; pass < p->passes; pass++) {
+        for (uint32_t i = 0; i < p->idle; i++) {
+            idler(&idle[i]);
+        }
+    }
+    r->idle_ns = cmp_ns_since(start, (uint64_t)p->passes * p->idle);
+    idle_go = 1;
+    for (uint32_t i = 0; i < p->idle; i++) {
+        if (PT_SCHEDULE(idler(&idle[i]))) {
+            fprintf(stderr, "pt: idle task %u didn't finish\n", i);
+            exit(1);
+        }
+    }
+    free(idle);
+    r->idle_bytes = sizeof(struct pt);
+    r->code_bytes = CMP_CODE_SIZE(pt);
+}
+#else
+void cmp_pt(struct cmp_result *r, const struct cmp_params *p)
+{
+    (void)p;
+    r->name = "Protothreads";
+    r->missing = "pt.h not found";
+}
+#endif
@@ -0,0 +1,225 @@
+// @file echo.c
+// Loopback echo server benchmark for the socket layer
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Usage: echo [connections] [rounds]
+//
+// One process runs both sides over 127.0.0.1: a listener task, one echo task
+// per accepted connection, and one client task per connection.  Every task
+// gets a 128-byte stack.  Reports connections per second (connect, echo all
+// rounds, close) and the round-trip latency percentiles.
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include "../asyncc_net.h"
+
+#define STACK_LEN   128
+#define MSG_LEN     32
+
+static struct async_runtime rt;
+static struct async_net net;
+static struct sockaddr_in server_addr;
+
+static struct async_task *tasks;
+static uint8_t (*stacks)[STACK_LEN];
+static uint32_t free_task;
+
+static int conns;
+static int rounds;
+static int clients_done;
+static uint64_t *lat;       // Round trip samples (ns)
+static uint32_t nlat;
+static uint64_t *sent_at;   // Per client send timestamp (ns)
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    fprintf(stderr, "stack overflow: %p needs %d more bytes\n", s, locals_size);
+    exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void spawn(async_task_fn fn, void *arg)
+{
+    uint32_t i = free_task++;
+    async_sched(&rt, &tasks[i], fn, arg, stacks[i], STACK_LEN);
+}
+
+enum async echo_task(uint8_t *s, void *arg)
+{
+    async_begin(s, int fd, int n, int sent, int w, uint8_t buf[MSG_LEN]);
+    l->fd = (int)(intptr_t)arg;
+
+    for (;;) {
+        await_recv(&net, l->fd, l->buf, MSG_LEN, l->n);
+        if (l->n <= 0) {
+            break;
+        }
+        for (l->sent = 0; l->sent < l->n; l->sent += l->w) {
+            await_send(&net, l->fd, l->buf + l->sent, l->n - l->sent, l->w);
+            if (l->w < 0) {
+                break;
+            }
+        }
+    }
+    close(l->fd);
+
+    async_end(s);
+}
+
+enum async listen_task(uint8_t *s, void *arg)
+{
+    async_begin(s, int fd, int conn);
+    l->fd = (int)(intptr_t)arg;
+
+    for (;;) {
+        await_accept(&net, l->fd, l->conn);
+        if (l->conn >= 0) {
+            spawn(echo_task, (void*)(intptr_t)l->conn);
+        }
+    }
+
+    async_end(s);
+}
+
+enum async client_task(uint8_t *s, void *arg)
+{
+    async_begin(s, int fd, int n, int got, uint16_t id, uint16_t round,
+            uint8_t buf[MSG_LEN]);
+    l->id = (uint16_t)(intptr_t)arg;
+    l->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    await_connect(&net, l->fd, &server_addr, sizeof(server_addr), l->n);
+    if (l->n < 0) {
+        perror("connect");
+        exit(1);
+    }
+
+    for (l->round = 0; l->round < rounds; l->round++) {
+        memset(l->buf, (uint8_t)l->round, MSG_LEN);
+        sent_at[l->id] = now_ns();
+        await_send(&net, l->fd, l->buf, MSG_LEN, l->n);
+        for (l->got = 0; l->got < MSG_LEN; l->got += l->n) {
+            await_recv(&net, l->fd, l->buf + l->got, MSG_LEN - l->got, l->n);
+            if (l->n <= 0) {
+                perror("recv");
+                exit(1);
+            }
+        }
+        lat[nlat++] = now_ns() - sent_at[l->id];
+    }
+    // The interest registered for this task goes before the task does
+    if (async_net_forget(&net, l->fd) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+    }
+    close(l->fd);
+    clients_done++;
+
+    async_end(s);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char **argv)
+{
+    conns = argc > 1 ? atoi(argv[1]) : 10000;
+    rounds = argc > 2 ? atoi(argv[2]) : 10;
+
+    // Two fds per connection (both ends live in this process)
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if ((rlim_t)conns * 2 + 16 > rl.rlim_cur) {
+        conns = (int)(rl.rlim_cur - 16) / 2;
+        printf("note: RLIMIT_NOFILE is %lu, using %d connections\n",
+                (unsigned long)rl.rlim_cur, conns);
+    }
+
+    tasks = calloc(2 * conns + 1, sizeof(*tasks));
+    stacks = calloc(2 * conns + 1, sizeof(*stacks));
+    lat = calloc((size_t)conns * rounds, sizeof(*lat));
+    sent_at = calloc(conns, sizeof(*sent_at));
+
+    async_rt_init(&rt);
+    if (async_net_init(&net, &rt) < 0) {
+        perror("epoll");
+        return 1;
+    }
+
+    int lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server_addr.sin_port = 0;
+    socklen_t alen = sizeof(server_addr);
+    if (bind(lfd, (struct sockaddr*)&server_addr, alen) < 0 || listen(lfd, 65535) < 0) {
+        perror("listen");
+        return 1;
+    }
+    getsockname(lfd, (struct sockaddr*)&server_addr, &alen);
+
+    uint64_t start = now_ns();
+    spawn(listen_task, (void*)(intptr_t)lfd);
+    for (int i = 0; i < conns; i++) {
+        spawn(client_task, (void*)(intptr_t)i);
+    }
+    while (clients_done < conns) {
+        async_run(&rt);
+        if (clients_done < conns) {
+            async_net_poll(&net, -1);
+        }
+    }
+    double secs = (now_ns() - start) / 1e9;
+
+    qsort(lat, nlat, sizeof(*lat), cmp_u64);
+    printf("tasks: %d x %d-byte stacks, %d rounds of %d bytes\n",
+            2 * conns + 1, STACK_LEN, rounds, MSG_LEN);
+    printf("connections/s: %.0f  (%d in %.3f s)\n", conns / secs, conns, secs);
+    printf("round trips/s: %.0f\n", nlat / secs);
+    printf("latency p50: %.1f us  p99: %.1f us  max: %.1f us\n",
+            lat[nlat / 2] / 1e3, lat[(uint64_t)nlat * 99 / 100] / 1e3,
+            lat[nlat - 1] / 1e3);
+
+    async_net_close(&net);
+    close(lfd);
+    return 0;
+}
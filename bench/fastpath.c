@@ -0,0 +1,175 @@
+// @file fastpath.c
+// Cost of awaits that are already satisfied when first reached
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Usage: fastpath [awaits] [percent ready]
+//
+// A request handler awaits a child per request, and the child awaits its I/O
+// flag.  The given percentage of flags (90 by default) are already set when
+// the await is reached, the rest are set by the driver after the task
+// suspends.  The same handler is built twice: once with the current await(),
+// and once with the old await (store the spot, then check the condition).
+// Both start each child with await_call(), so the cost of marking the
+// child's frame fresh is measured on its own, with a flat loop of awaits on
+// the flags built with await() and with await_call().
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../asyncc.h"
+
+// The pre-fast-path await, kept here for comparison
+#define old_await_while(cond)                                       \
+    l->spot = __LINE__; case __LINE__:                              \
+    if (cond) { a_extent(); a_pop(); return ASYNC_CONT; }
+#define old_await(cond) old_await_while(!(cond))
+#define old_await_call(cond) a_fresh(); old_await(cond)
+
+static uint8_t *ready;
+static uint32_t count;
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    fprintf(stderr, "stack overflow: %p needs %d more bytes\n", s, locals_size);
+    exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+__attribute__((noinline)) enum async new_child(uint8_t *s, uint32_t i)
+{
+    async_begin(s);
+    await(ready[i]);
+    async_end(s);
+}
+
+__attribute__((noinline)) enum async new_handler(uint8_t *s, uint32_t *sum)
+{
+    async_begin(s, uint32_t i);
+    for (l->i = 0; l->i < count; l->i++) {
+        await_call(new_child(s, l->i));
+        *sum += l->i;
+    }
+    async_end(s);
+}
+
+__attribute__((noinline)) enum async old_child(uint8_t *s, uint32_t i)
+{
+    async_begin(s);
+    old_await(ready[i]);
+    async_end(s);
+}
+
+__attribute__((noinline)) enum async old_handler(uint8_t *s, uint32_t *sum)
+{
+    async_begin(s, uint32_t i);
+    for (l->i = 0; l->i < count; l->i++) {
+        old_await_call(old_child(s, l->i));
+        *sum += l->i;
+    }
+    async_end(s);
+}
+
+__attribute__((noinline)) enum async flat_handler(uint8_t *s, uint32_t *sum)
+{
+    async_begin(s, uint32_t i);
+    for (l->i = 0; l->i < count; l->i++) {
+        await(ready[l->i]);
+        *sum += l->i;
+    }
+    async_end(s);
+}
+
+__attribute__((noinline)) enum async fresh_handler(uint8_t *s, uint32_t *sum)
+{
+    async_begin(s, uint32_t i);
+    for (l->i = 0; l->i < count; l->i++) {
+        await_call(ready[l->i]);
+        *sum += l->i;
+    }
+    async_end(s);
+}
+
+// Run a handler to completion, completing the I/O for every suspension
+static double run(enum async (*handler)(uint8_t*, uint32_t*), uint8_t *init,
+        uint32_t *sum, uint32_t *suspends)
+{
+    uint8_t stack[64];
+    async_init(stack, sizeof(stack));
+    for (uint32_t i = 0; i < count; i++) {
+        ready[i] = init[i];
+    }
+
+    uint32_t blocked = 0;
+    uint64_t start = now_ns();
+    while (handler(stack, sum) != ASYNC_DONE) {
+        // The handler is blocked on the first unset flag
+        while (ready[blocked]) {
+            blocked++;
+        }
+        ready[blocked] = 1;
+        (*suspends)++;
+    }
+    return (double)(now_ns() - start) / count;
+}
+
+int main(int argc, char **argv)
+{
+    count = argc > 1 ? (uint32_t)atoi(argv[1]) : 10000000;
+    int pct = argc > 2 ? atoi(argv[2]) : 90;
+
+    ready = malloc(count);
+    uint8_t *init = malloc(count);
+    srand(1);
+    for (uint32_t i = 0; i < count; i++) {
+        init[i] = rand() % 100 < pct;
+    }
+
+    uint32_t sum = 0, suspends = 0;
+    double best_new = 1e9, best_old = 1e9, best_flat = 1e9, best_fresh = 1e9;
+    for (int rep = 0; rep < 5; rep++) {
+        double t = run(new_handler, init, &sum, &suspends);
+        best_new = t < best_new ? t : best_new;
+        t = run(old_handler, init, &sum, &suspends);
+        best_old = t < best_old ? t : best_old;
+        t = run(flat_handler, init, &sum, &suspends);
+        best_flat = t < best_flat ? t : best_flat;
+        t = run(fresh_handler, init, &sum, &suspends);
+        best_fresh = t < best_fresh ? t : best_fresh;
+    }
+
+    printf("%u awaits, %d%% ready on first check, %u suspensions per run\n",
+            count, pct, suspends / 20);
+    printf("store-first await: %.2f ns/await\n", best_old);
+    printf("fast-path await:   %.2f ns/await (%.1f%%)\n", best_new,
+            100.0 * (best_new - best_old) / best_old);
+    printf("fresh frame:       %+.2f ns/await_call (%.2f vs %.2f flat)\n",
+            best_fresh - best_flat, best_fresh, best_flat);
+    return 0;
+}
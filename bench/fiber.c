@@ -0,0 +1,183 @@
+// @file fiber.c
+// Switch cost and memory of fiber tasks next to native stackless tasks
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Usage: fiber [tasks] [yields per task] [fiber stack bytes]
+//
+// The given number of tasks (1000 by default) each yield the given number of
+// times (1000 by default), once as native async functions and once as fibers
+// with stacks of the given size (16384 by default).  Prints the time per
+// resume and the memory per task each way.
+//
+// Then a legacy-style parser that only knows how to pull its input through a
+// callback, from the bottom of a recursive descent, runs as a fiber fed by a
+// native task through a link (asyncc_pipe.h), and checks what it parsed.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../asyncc_fiber.h"
+#include "../asyncc_pipe.h"
+
+#define STACK_LEN   32
+#define DEPTH       64
+#define ITEMS       100000
+
+static struct async_runtime rt;
+static uint32_t yields;
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    fprintf(stderr, "stack overflow: %p needs %d more bytes\n", s, locals_size);
+    exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+enum async native(uint8_t *s, void *arg)
+{
+    (void)arg;
+    async_begin(s, uint32_t i);
+    for (l->i = 0; l->i < yields; l->i++) {
+        async_yield;
+    }
+    async_end(s);
+}
+
+static void spinner(struct async_fiber *f, void *arg)
+{
+    (void)arg;
+    for (uint32_t i = 0; i < yields; i++) {
+        async_fiber_yield(f);
+    }
+}
+
+static double run(uint64_t *resumes)
+{
+    uint64_t n = 0;
+    uint64_t start = now_ns();
+    while (async_next(&rt)) {
+        n++;
+    }
+    *resumes = n;
+    return (double)(now_ns() - start) / n;
+}
+
+// The legacy side: a recursive parser that pulls numbers through a callback
+// and sums the ones at the bottom of its recursion
+static void *link_ring[16];
+static uint8_t feeder_stack[64];
+static struct async_link link;
+
+static long pull(void)
+{
+    struct async_fiber *f = async_fiber_self();
+    void *item = NULL;
+    async_fiber_await(f, async_link_recv(f->s, &link, &item));
+    async_link_done(&link);
+    return item ? (long)(uintptr_t)item : -1;
+}
+
+static long descend(int depth)
+{
+    if (depth) {
+        return descend(depth - 1);
+    }
+    long sum = 0;
+    for (long v; (v = pull()) >= 0; ) {
+        sum += v;
+    }
+    return sum;
+}
+
+static long parsed;
+
+static void parser(struct async_fiber *f, void *arg)
+{
+    (void)f;
+    (void)arg;
+    parsed = descend(DEPTH);
+}
+
+enum async feeder(uint8_t *s, void *arg)
+{
+    (void)arg;
+    async_begin(s, uintptr_t i);
+    for (l->i = 1; l->i <= ITEMS; l->i++) {
+        await_link_send(s, &link, (void*)l->i);
+    }
+    async_link_close(&link);
+    async_end(s);
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 1000;
+    yields = argc > 2 ? (uint32_t)atoi(argv[2]) : 1000;
+    size_t fiber_len = argc > 3 ? (size_t)atoi(argv[3]) : 16384;
+
+    struct async_task *tasks = calloc(n, sizeof(*tasks));
+    uint8_t (*stacks)[STACK_LEN] = calloc(n, STACK_LEN);
+    struct async_fiber *fibers = calloc(n, sizeof(*fibers));
+    uint8_t *fiber_stacks = aligned_alloc(16, (size_t)n * fiber_len);
+
+    uint64_t resumes;
+    async_rt_init(&rt);
+    for (int i = 0; i < n; i++) {
+        async_sched(&rt, &tasks[i], native, NULL, stacks[i], STACK_LEN);
+    }
+    double ns = run(&resumes);
+    printf("native: %8llu resumes, %6.1f ns/resume, %4d bytes/task\n",
+            (unsigned long long)resumes, ns,
+            (int)(STACK_LEN + sizeof(struct async_task)));
+
+    async_rt_init(&rt);
+    for (int i = 0; i < n; i++) {
+        async_fiber_sched(&rt, &tasks[i], &fibers[i], spinner, NULL,
+                fiber_stacks + i * fiber_len, fiber_len);
+    }
+    ns = run(&resumes);
+    printf("fiber:  %8llu resumes, %6.1f ns/resume, %4d bytes/task "
+            "(+ %zu byte stack)\n", (unsigned long long)resumes, ns,
+            (int)(sizeof(struct async_fiber) + sizeof(struct async_task)), fiber_len);
+
+    // Legacy parser in a fiber, fed from a native task
+    async_rt_init(&rt);
+    async_link_init(&link, &rt, link_ring, 16);
+    async_fiber_sched(&rt, &tasks[0], &fibers[0], parser, NULL, fiber_stacks, fiber_len);
+    async_sched(&rt, &tasks[1], feeder, NULL, feeder_stack,
+            sizeof(feeder_stack));
+    uint64_t start = now_ns();
+    async_run(&rt);
+    long want = (long)ITEMS * (ITEMS + 1) / 2;
+    printf("parser: %d items through a callback %d calls deep, %.1f ns/item, "
+            "sum %s\n", ITEMS, DEPTH, (double)(now_ns() - start) / ITEMS,
+            parsed == want ? "ok" : "WRONG");
+    return parsed != want;
+}
@@ -0,0 +1,193 @@
+// @file hibernate.c
+// Round trip parked tasks through a hibernation store
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Usage: lag [seconds]
+// Usage: hibernate [tasks]
+//
+// The given number of tasks (10000 by default) park on a shared round
+// counter.  Each round every parked task is hibernated into a store slot,
+// the counter is bumped and the tasks are woken (which cold tasks ignore),
+// and then each is thawed into the other of two stack buffers, where it
+// re-checks the counter and carries on.  Every task sums its rounds in its
+// frame, so a frame that came back wrong shows up as a bad sum.  Along the
+// way, a torn image, one from another build, a truncated one, and one that
+// was already restored must all be rejected.  Prints the time per hibernate
+// and thaw.
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// A real build derives this from its sources (see asyncc_hibernate.h), this
+// bench is a single file
+#define ASYNC_BUILD_ID      0x48424e31u
+#ifndef ASYNC_TRACK_EXTENT
+#define ASYNC_TRACK_EXTENT
+#endif
+#include "../asyncc_hibernate.h"
+
+#define STACK_LEN   64
+#define SLOT_LEN    128
+#define ROUNDS      4
+
+static struct async_runtime rt;
+static struct async_task *tasks;
+static uint8_t (*stacks[2])[STACK_LEN];
+static uint32_t *sums;
+static uint8_t round_no;
+static int failed;
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    fprintf(stderr, "stack overflow: %p needs %d more bytes\n", s, locals_size);
+    exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+enum async sleeper(uint8_t *s, void *arg)
+{
+    async_begin(s, uint32_t id, uint32_t sum, uint8_t seen);
+    l->id = (uint32_t)(uintptr_t)arg;
+    l->sum = 0;
+    for (l->seen = 0; l->seen < ROUNDS; l->seen++) {
+        await_parked(&rt, round_no > l->seen);
+        l->sum += l->id * (l->seen + 1u);
+    }
+    sums[l->id] = l->sum;
+    async_end(s);
+}
+
+static void expect_image(const char *what, enum async_image got, enum async_image want)
+{
+    static const char *const names[] = {"ok", "nospace", "pinned", "stale", "corrupt"};
+    printf("%-24s %s\n", what, names[got]);
+    if (got != want) {
+        printf("FAIL: expected %s\n", names[want]);
+        failed = 1;
+    }
+}
+
+// Damaged images of task 0 (just hibernated into slot 0) must be rejected,
+// and the intact one restored exactly once
+static void rejects(struct async_store *st, uint8_t *into)
+{
+    uint8_t *slot = async_store_slot(st, 0);
+    uint8_t copy[SLOT_LEN];
+    struct async_image_hdr h;
+    memcpy(copy, slot, SLOT_LEN);
+    memcpy(&h, slot, sizeof(h));
+
+    slot[sizeof(h) + h.used - 1] ^= 0x40;
+    expect_image("torn frame:", async_task_thaw(&rt, st, 0, &tasks[0], into, 0),
+            ASYNC_IMAGE_CORRUPT);
+    memcpy(slot, copy, SLOT_LEN);
+
+    ((struct async_image_hdr*)slot)->build ^= 1;
+    expect_image("other build:", async_task_thaw(&rt, st, 0, &tasks[0], into, 0),
+            ASYNC_IMAGE_STALE);
+    memcpy(slot, copy, SLOT_LEN);
+
+    expect_image("truncated:", async_restore_from(into, 0, slot, sizeof(h) + h.used - 1),
+            ASYNC_IMAGE_CORRUPT);
+    expect_image("intact:", async_task_thaw(&rt, st, 0, &tasks[0], into, 0),
+            ASYNC_IMAGE_OK);
+    expect_image("already restored:", async_restore_from(into, 0, slot, SLOT_LEN),
+            ASYNC_IMAGE_CORRUPT);
+    expect_image("thawed twice:", async_task_thaw(&rt, st, 0, &tasks[0], into, 0),
+            ASYNC_IMAGE_STALE);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t n = argc > 1 ? (uint32_t)atoi(argv[1]) : 10000;
+    char path[64];
+    struct async_store st;
+    tasks = calloc(n, sizeof(*tasks));
+    stacks[0] = calloc(n, STACK_LEN);
+    stacks[1] = calloc(n, STACK_LEN);
+    sums = calloc(n, sizeof(*sums));
+
+    snprintf(path, sizeof(path), "/tmp/asyncc_hibernate_%d", (int)getpid());
+    if (async_store_open(&st, path, n, SLOT_LEN) < 0) {
+        perror(path);
+        return 1;
+    }
+    unlink(path);
+
+    async_rt_init(&rt);
+    for (uint32_t i = 0; i < n; i++) {
+        async_sched(&rt, &tasks[i], sleeper, (void*)(uintptr_t)i, stacks[0][i], STACK_LEN);
+    }
+
+    uint64_t t_hib = 0, t_thaw = 0;
+    for (round_no = 0; round_no < ROUNDS; ) {
+        async_run(&rt);
+        uint64_t start = now_ns();
+        for (uint32_t i = 0; i < n; i++) {
+            if (async_task_hibernate(&st, i, &tasks[i]) != ASYNC_IMAGE_OK) {
+                printf("FAIL: task %u not hibernated\n", i);
+                return 1;
+            }
+        }
+        t_hib += now_ns() - start;
+
+        round_no++;
+        for (uint32_t i = 0; i < n; i++) {
+            async_wake(&rt, &tasks[i]);         // Cold, so ignored
+        }
+        uint8_t (*into)[STACK_LEN] = stacks[round_no & 1];
+        uint32_t first = 0;
+        if (round_no == 1) {
+            rejects(&st, into[0]);
+            first = 1;
+        }
+        start = now_ns();
+        for (uint32_t i = first; i < n; i++) {
+            if (async_task_thaw(&rt, &st, i, &tasks[i], into[i], 0) != ASYNC_IMAGE_OK) {
+                printf("FAIL: task %u not thawed\n", i);
+                return 1;
+            }
+        }
+        t_thaw += now_ns() - start;
+    }
+    async_run(&rt);
+
+    uint32_t bad = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        bad += sums[i] != i * (ROUNDS * (ROUNDS + 1) / 2);
+    }
+    printf("%u tasks, %d rounds: hibernate %.0f ns, thaw %.0f ns per task, "
+            "%u bad sums\n", n, ROUNDS, (double)t_hib / n / ROUNDS,
+            (double)t_thaw / n / ROUNDS, bad);
+    async_store_close(&st);
+    return failed || bad || rt.tasks;
+}
@@ -0,0 +1,167 @@
+// @file lag.c
+// Loop lag histogram and stall watchdog
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Usage: lag [seconds]
+//
+// 64 tasks each do about a microsecond of work per resume, and one hog task
+// blocks for 20 ms every 2000 passes.  A watchdog thread checks the runtime
+// every millisecond with a 5 ms limit and prints each stall it catches (with
+// the logical backtrace of the hog), and at the end the loop lag percentiles
+// are printed (the hog shows up as the max).  Build with -DNO_MONITOR to see
+// what the monitoring costs in resumes per second.
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+static uint32_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000000u + ts.tv_nsec / 1000);
+}
+
+#ifndef NO_MONITOR
+#define ASYNC_MONITOR
+#define ASYNC_TRACE
+#define ASYNC_NOW() now_us()
+#endif
+#include "../asyncc_rt.h"
+
+#define TASKS       64
+#define STACK_LEN   64
+
+static struct async_runtime rt;
+static struct async_task tasks[TASKS + 1];
+static uint8_t stacks[TASKS + 1][STACK_LEN];
+static volatile uint32_t sink;
+static volatile int stop;
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    fprintf(stderr, "stack overflow: %p needs %d more bytes\n", s, locals_size);
+    exit(1);
+}
+
+static void burn(uint32_t n)
+{
+    uint32_t x = sink;
+    for (uint32_t i = 0; i < n; i++) {
+        x = x * 1103515245u + 12345u;
+    }
+    sink = x;
+}
+
+enum async worker(uint8_t *s, void *arg)
+{
+    (void)arg;
+    async_begin(s);
+    while (!stop) {
+        burn(500);
+        async_yield;
+    }
+    async_end(s);
+}
+
+enum async compact_index(uint8_t *s)
+{
+    async_begin(s);
+    struct timespec ts = {0, 20000000};
+    nanosleep(&ts, NULL);   // Stands in for 20 ms of blocking work
+    async_end(s);
+}
+
+enum async hog(uint8_t *s, void *arg)
+{
+    (void)arg;
+    async_begin(s, uint32_t pass);
+    while (!stop) {
+        if (++l->pass % 2000 == 0) {
+            *(uint16_t*)(s + IDX(s)) = ASYNC_INIT;
+            await_call(compact_index(s));
+        }
+        async_yield;
+    }
+    async_end(s);
+}
+
+#ifndef NO_MONITOR
+static void *watchdog(void *arg)
+{
+    (void)arg;
+    struct timespec ts = {0, 1000000};
+    while (!stop) {
+        nanosleep(&ts, NULL);
+        if (async_watchdog(&rt, now_us(), 5000)) {
+            struct async_stall *st = &rt.stall;
+            printf("stall: task %d running for %u us, IDX %u/%u, SPOT %u:",
+                    (int)(st->task - tasks), st->ran, st->idx, st->max, st->spot);
+            for (uint16_t i = 0; i < st->depth; i++) {
+                printf(" %s", st->frames[i].func->name);
+            }
+            printf("\n");
+        }
+    }
+    return NULL;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    double secs = argc > 1 ? atof(argv[1]) : 2.0;
+
+    async_rt_init(&rt);
+    for (int i = 0; i < TASKS; i++) {
+        async_sched(&rt, &tasks[i], worker, NULL, stacks[i], STACK_LEN);
+    }
+    async_sched(&rt, &tasks[TASKS], hog, NULL, stacks[TASKS], STACK_LEN);
+
+#ifndef NO_MONITOR
+    pthread_t wd;
+    pthread_create(&wd, NULL, watchdog, NULL);
+#endif
+
+    uint32_t start = now_us();
+    uint64_t resumes = 0;
+    while (now_us() - start < secs * 1e6) {
+        for (int i = 0; i < 1000; i++) {
+            async_next(&rt);
+        }
+        resumes += 1000;
+    }
+    double elapsed = (now_us() - start) / 1e6;
+    stop = 1;
+    async_run(&rt);
+
+#ifndef NO_MONITOR
+    pthread_join(wd, NULL);
+    printf("%u stalls caught, loop lag p50 < %u us, p99 < %u us, max < %u us\n",
+            rt.stalls, async_lag_percentile(&rt, 50), async_lag_percentile(&rt, 99),
+            async_lag_percentile(&rt, 100));
+#endif
+    printf("%.2f M resumes/s\n", resumes / elapsed / 1e6);
+    return 0;
+}
@@ -0,0 +1,129 @@
+// @file log.c
+// Durable appends per second against how many tasks append at once
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Usage: log [file] [seconds per level]
+//
+// For 1 to 256 concurrent tasks, each task appends 64 byte records to the
+// log (truncated first, /tmp/asyncc_log.bench by default) and awaits each
+// one's fdatasync before appending the next.  Prints durable records per
+// second and the mean records per sync.  One task is the fsync-per-record
+// baseline.
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../asyncc_log.h"
+
+#define MAX_TASKS   256
+#define STACK_LEN   160
+
+static struct async_runtime rt;
+static struct async_net net;
+static struct async_log log_;
+static struct async_task tasks[MAX_TASKS + 1];
+static uint8_t stacks[MAX_TASKS + 1][STACK_LEN];
+static volatile int stop;
+static uint32_t failed;
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    fprintf(stderr, "stack overflow: %p needs %d more bytes\n", s, locals_size);
+    exit(1);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+enum async appender(uint8_t *s, void *arg)
+{
+    async_begin(s, uint32_t seq, struct async_log_rec rec, char buf[64]);
+    while (!stop) {
+        memset(l->buf, ' ', sizeof(l->buf));
+        int k = snprintf(l->buf, sizeof(l->buf), "task %d record %u",
+                (int)(intptr_t)arg, l->seq++);
+        l->buf[k] = ' ';
+        l->buf[sizeof(l->buf) - 1] = '\n';
+        l->rec.data = l->buf;
+        l->rec.len = sizeof(l->buf);
+        await_log_append(&log_, l->rec);
+        failed += l->rec.res < 0;
+    }
+    async_end(s);
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : "/tmp/asyncc_log.bench";
+    double secs = argc > 2 ? atof(argv[2]) : 1.0;
+
+    printf("tasks   records/s   records/sync\n");
+    for (int n = 1; n <= MAX_TASKS; n *= 4) {
+        async_rt_init(&rt);
+        async_net_init(&net, &rt);
+        if (truncate(path, 0) < 0 && errno != ENOENT) {
+            perror(path);
+            return 1;
+        }
+        if (async_log_open(&log_, &net, path) < 0) {
+            perror(path);
+            return 1;
+        }
+        async_sched(&rt, &tasks[MAX_TASKS], async_log_task, &log_,
+                stacks[MAX_TASKS], STACK_LEN);
+        for (int i = 0; i < n; i++) {
+            async_sched(&rt, &tasks[i], appender, (void*)(intptr_t)i, stacks[i], STACK_LEN);
+        }
+
+        stop = 0;
+        double start = now();
+        while (now() - start < secs) {
+            async_run(&rt);
+            async_net_poll(&net, 10);
+        }
+        stop = 1;
+        while (rt.tasks > 1) {
+            async_run(&rt);
+            async_net_poll(&net, 10);
+        }
+        double elapsed = now() - start;
+        async_log_stop(&log_);
+        async_run(&rt);
+        async_log_close(&log_);
+        async_net_close(&net);
+
+        printf("%5d %11.0f %14.1f\n", n, log_.records / elapsed,
+                (double)log_.records / log_.batches);
+    }
+    if (failed) {
+        printf("%u appends failed\n", failed);
+    }
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,326 @@
+// @file metrics.c
+// Sharded runtime counters, scraped over HTTP while the shards run
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Usage: metrics [seconds]
+//
+// Two runtimes on two threads each run 32 tasks that yield, 16 pairs of
+// tasks that park and wake each other, and a fan-out over a pool that is
+// smaller than its work list.  The first also runs async_metrics_task() on a
+// free loopback port, which the main thread scrapes like Prometheus would,
+// once mid run (printed) and every 10 ms the rest of the time.  Before that a
+// client connects and never sends anything, and must be dropped once its
+// ASYNC_METRICS_TIMEOUT has passed so the scrapes get through.  Build with
+// -DNO_METRICS to see what the counters cost in resumes per second.
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#ifndef NO_METRICS
+#define ASYNC_METRICS
+#define ASYNC_METRICS_TIMEOUT 100
+#endif
+#include "../asyncc_net.h"
+#ifndef NO_METRICS
+#include "../asyncc_metrics.h"
+#include <arpa/inet.h>
+#endif
+
+#define SHARDS      2
+#define YIELDERS    32
+#define PAIRS       16
+#define STACK_LEN   128
+
+struct shard;
+
+struct pair {
+    struct shard *sh;
+    struct async_task *ping;
+    struct async_task *pong;
+    uint8_t turn;
+};
+
+struct shard {
+    struct async_runtime rt;
+    struct async_net net;
+    struct async_task tasks[YIELDERS + 2 * PAIRS + 2];
+    uint8_t stacks[YIELDERS + 2 * PAIRS + 1][STACK_LEN];
+    struct pair pairs[PAIRS];
+    uint64_t resumes;
+};
+
+static struct shard shards[SHARDS];
+static volatile int stop;
+static volatile uint32_t sink;
+
+#ifndef NO_METRICS
+static struct async_metrics reg;
+static struct async_metrics_http http;
+static uint8_t http_stack[ASYNC_METRICS_STACK];
+static struct async_timers timers;
+static struct async_inbox inbox;    // Of the first shard
+#endif
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    fprintf(stderr, "stack overflow: %p needs %d more bytes\n", s, locals_size);
+    exit(1);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+enum async yielder(uint8_t *s, void *arg)
+{
+    (void)arg;
+    async_begin(s);
+    while (!stop) {
+        sink++;
+        async_yield;
+    }
+    async_end(s);
+}
+
+enum async ping(uint8_t *s, void *arg)
+{
+    struct pair *p = arg;
+    async_begin(s);
+    while (!stop) {
+        await_parked(&p->sh->rt, p->turn == 0);
+        p->turn = 1;
+        async_wake(&p->sh->rt, p->pong);
+    }
+    async_end(s);
+}
+
+enum async pong(uint8_t *s, void *arg)
+{
+    struct pair *p = arg;
+    async_begin(s);
+    while (!stop) {
+        await_parked(&p->sh->rt, p->turn == 1);
+        p->turn = 0;
+        async_wake(&p->sh->rt, p->ping);
+    }
+    async_end(s);
+}
+
+enum async step(uint8_t *s, uint8_t *item)
+{
+    async_begin(s);
+    async_yield;
+    (*item)++;
+    async_end(s);
+}
+
+enum async fan_out(uint8_t *s, void *arg)
+{
+    (void)arg;
+    async_begin(s, uint8_t items[8], ASYNC_POOL(pool, 2, 16));
+    while (!stop) {
+        await_for_each_n(l->items, 8, step, 2, l->pool);
+    }
+    async_end(s);
+}
+
+static void *run(void *arg)
+{
+    struct shard *sh = arg;
+    while (!stop) {
+        for (int i = 0; i < 256; i++) {
+            async_next(&sh->rt);
+        }
+        sh->resumes += 256;
+        async_net_poll(&sh->net, 0);
+#ifndef NO_METRICS
+        if (sh == &shards[0]) {
+            async_inbox_drain(&inbox);
+        }
+#endif
+    }
+    return NULL;
+}
+
+#ifndef NO_METRICS
+static void *tick(void *arg)
+{
+    (void)arg;
+    struct timespec ts = {0, 1000000};
+    while (!stop) {
+        nanosleep(&ts, NULL);
+        ASYNC_TICK(&timers, 1);
+    }
+    return NULL;
+}
+
+static int dial(uint16_t port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    return fd;
+}
+
+// One scrape, returns the size of the response
+static size_t scrape(uint16_t port, int print)
+{
+    int fd = dial(port);
+    const char req[] = "GET /metrics HTTP/1.0\r\n\r\n";
+    if (write(fd, req, sizeof(req) - 1) < 0) {
+        perror("write");
+        exit(1);
+    }
+    char buf[4096];
+    size_t got = 0;
+    ssize_t n;
+    while ((n = read(fd, buf + got, sizeof(buf) - 1 - got)) > 0) {
+        got += n;
+    }
+    buf[got] = 0;
+    close(fd);
+    if (print) {
+        char *body = strstr(buf, "\r\n\r\n");
+        printf("%s", body ? body + 4 : buf);
+    }
+    return got;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+    double secs = argc > 1 ? atof(argv[1]) : 2.0;
+
+    for (int i = 0; i < SHARDS; i++) {
+        struct shard *sh = &shards[i];
+        int t = 0;
+        async_rt_init(&sh->rt);
+        async_net_init(&sh->net, &sh->rt);
+        for (int j = 0; j < YIELDERS; j++, t++) {
+            async_sched(&sh->rt, &sh->tasks[t], yielder, NULL, sh->stacks[t], STACK_LEN);
+        }
+        for (int j = 0; j < PAIRS; j++, t += 2) {
+            struct pair *p = &sh->pairs[j];
+            p->sh = sh;
+            p->ping = &sh->tasks[t];
+            p->pong = &sh->tasks[t + 1];
+            async_sched(&sh->rt, p->ping, ping, p, sh->stacks[t], STACK_LEN);
+            async_sched(&sh->rt, p->pong, pong, p, sh->stacks[t + 1], STACK_LEN);
+        }
+        async_sched(&sh->rt, &sh->tasks[t], fan_out, NULL, sh->stacks[t], STACK_LEN);
+#ifndef NO_METRICS
+        async_metrics_add(&reg, &sh->rt);
+#endif
+    }
+
+#ifndef NO_METRICS
+    async_timers_init(&timers);
+    async_inbox_init(&inbox, &shards[0].rt, &timers, NULL, NULL);
+    http.net = &shards[0].net;
+    http.reg = &reg;
+    http.ib = &inbox;
+    http.fd = async_metrics_listen(INADDR_LOOPBACK, 0);
+    if (http.fd < 0) {
+        perror("listen");
+        return 1;
+    }
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    getsockname(http.fd, (struct sockaddr*)&addr, &addrlen);
+    uint16_t port = ntohs(addr.sin_port);
+    async_sched(&shards[0].rt, &shards[0].tasks[YIELDERS + 2 * PAIRS + 1],
+            async_metrics_task, &http, http_stack, sizeof(http_stack));
+#endif
+
+    pthread_t th[SHARDS];
+    double start = now();
+    for (int i = 0; i < SHARDS; i++) {
+        pthread_create(&th[i], NULL, run, &shards[i]);
+    }
+
+#ifndef NO_METRICS
+    pthread_t ticker;
+    pthread_create(&ticker, NULL, tick, NULL);
+
+    // A client that never sends holds the task for one to two timeouts, then
+    // reads the end of the stream (or gives up waiting for it)
+    int slow = dial(port);
+    struct timeval tv = {0, 3 * ASYNC_METRICS_TIMEOUT * 1000};
+    setsockopt(slow, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    double t0 = now();
+    char c;
+    ssize_t eof = read(slow, &c, 1);
+    double held = now() - t0;
+    if (eof != 0) {
+        fprintf(stderr, "FAIL: silent client not dropped in time (%.0f ms)\n",
+                held * 1e3);
+        return 1;
+    }
+    close(slow);
+    printf("silent client dropped after %.0f ms\n", held * 1e3);
+
+    uint32_t scrapes = 0;
+    size_t size = 0;
+    double scrape_time = 0;
+    struct timespec ts = {0, 10000000};
+    while (now() - start < secs) {
+        double t = now();
+        size = scrape(port, scrapes == 10);
+        scrape_time += now() - t;
+        scrapes++;
+        nanosleep(&ts, NULL);
+    }
+#else
+    struct timespec ts = {(time_t)secs, (long)((secs - (time_t)secs) * 1e9)};
+    nanosleep(&ts, NULL);
+#endif
+    stop = 1;
+    double elapsed = now() - start;
+
+    uint64_t resumes = 0;
+    for (int i = 0; i < SHARDS; i++) {
+        pthread_join(th[i], NULL);
+        resumes += shards[i].resumes;
+    }
+#ifndef NO_METRICS
+    pthread_join(ticker, NULL);
+    printf("%u scrapes of %zu bytes, %.1f us each\n", scrapes, size,
+            scrape_time / scrapes * 1e6);
+#endif
+    printf("%.2f M resumes/s over %d shards\n", resumes / elapsed / 1e6, SHARDS);
+    return 0;
+}
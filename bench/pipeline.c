@@ -0,0 +1,171 @@
+// @file pipeline.c
+// Three stage pipeline into a throttled sink, with and without backpressure
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Usage: pipeline [seconds per run] [sink us per item]
+//
+// A source allocates 1 KiB items as fast as it can, a transform stage fills
+// them in, and the sink takes 20 us per item (waiting by yielding) before it
+// frees them.  With 16 slot links the source is held back by credit; the
+// same pipeline with 32768 slot links stands in for a big global buffer.
+// Prints the sink's throughput over the second half of the run (steady
+// state) and the most items and bytes that were ever allocated at once.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../asyncc_pipe.h"
+
+#define ITEM        1024
+#define STACK_LEN   96
+#define BIG         32768
+
+struct stage {
+    struct async_link *in;
+    struct async_link *out;
+};
+
+static struct async_runtime rt;
+static struct async_task tasks[3];
+static uint8_t stacks[3][STACK_LEN];
+static struct async_link a, b;
+static void *ring_a[BIG], *ring_b[BIG];
+static struct stage mid = {&a, &b}, last = {&b, NULL};
+static uint64_t live, peak, made, sunk, half_sunk, bad;
+static uint64_t sink_ns;
+static volatile int stop, half;
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    fprintf(stderr, "stack overflow: %p needs %d more bytes\n", s, locals_size);
+    exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+enum async source(uint8_t *s, void *arg)
+{
+    (void)arg;
+    async_begin(s, uint64_t *item);
+    while (!stop) {
+        l->item = malloc(ITEM);
+        l->item[0] = made++;
+        live++;
+        peak = live > peak ? live : peak;
+        await_link_send(s, &a, l->item);
+    }
+    async_link_close(&a);
+    async_end(s);
+}
+
+enum async transform(uint8_t *s, void *arg)
+{
+    struct stage *st = arg;
+    async_begin(s, uint64_t *item);
+    for (;;) {
+        await_link_recv(s, st->in, &l->item);
+        if (!l->item) {
+            break;
+        }
+        for (int i = 1; i < ITEM / 8; i++) {
+            l->item[i] = l->item[0] + i;
+        }
+        await_link_send(s, st->out, l->item);
+        // The item lives on downstream, b's credit bounds it from here
+        async_link_done(st->in);
+    }
+    async_link_close(st->out);
+    async_end(s);
+}
+
+enum async sink(uint8_t *s, void *arg)
+{
+    struct stage *st = arg;
+    async_begin(s, uint64_t *item, uint64_t until);
+    for (;;) {
+        await_link_recv(s, st->in, &l->item);
+        if (!l->item) {
+            break;
+        }
+        // Throttled: the sink takes sink_ns per item (until the run is over)
+        l->until = now_ns() + sink_ns;
+        while (!stop && now_ns() < l->until) {
+            async_yield;
+        }
+        bad += l->item[ITEM / 8 - 1] != l->item[0] + ITEM / 8 - 1;
+        free(l->item);
+        live--;
+        sunk++;
+        half_sunk += half;
+        async_link_done(st->in);
+    }
+    async_end(s);
+}
+
+static void run(uint16_t size, double secs)
+{
+    async_rt_init(&rt);
+    async_link_init(&a, &rt, ring_a, size);
+    async_link_init(&b, &rt, ring_b, size);
+    live = peak = made = sunk = half_sunk = 0;
+    stop = half = 0;
+    memset(stacks, 0, sizeof(stacks));
+    async_sched(&rt, &tasks[0], source, NULL, stacks[0], STACK_LEN);
+    async_sched(&rt, &tasks[1], transform, &mid, stacks[1], STACK_LEN);
+    async_sched(&rt, &tasks[2], sink, &last, stacks[2], STACK_LEN);
+
+    uint64_t start = now_ns(), end = start + (uint64_t)(secs * 1e9);
+    uint64_t mid_at = start + (end - start) / 2, t;
+    while ((t = now_ns()) < end) {
+        half = t >= mid_at;
+        for (int i = 0; i < 64; i++) {
+            async_next(&rt);
+        }
+    }
+    stop = 1;
+    half = 0;
+    async_run(&rt);
+
+    printf("%5u slot links: %7.0f items/s at the sink, peak %6llu items "
+            "(%6.0f KiB), %8u credit stalls\n", size, half_sunk / (secs / 2),
+            (unsigned long long)peak, peak * (double)ITEM / 1024, a.stalls);
+}
+
+int main(int argc, char **argv)
+{
+    double secs = argc > 1 ? atof(argv[1]) : 1.0;
+    sink_ns = (argc > 2 ? atoi(argv[2]) : 20) * 1000;
+
+    run(16, secs);
+    run(BIG, secs);
+    if (bad) {
+        printf("%llu items corrupt\n", (unsigned long long)bad);
+    }
+    return bad != 0;
+}
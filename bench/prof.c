@@ -0,0 +1,151 @@
+// @file prof.c
+// Folded async stacks from the sampling profiler
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Usage: prof [seconds] > out.folded
+//        flamegraph.pl out.folded > async.svg
+//
+// A few tasks with known costs: a request handler that awaits parse() and
+// then checksum() (about three times the work of parse()), and a housekeeping
+// task that does a little work per pass.  The folded stacks go to stdout, and
+// the sample counts per function go to stderr, so it is easy to check that
+// the profile matches the work done.
+
+#define ASYNC_TRACE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../asyncc_prof.h"
+
+#define STACK_LEN   128
+
+static struct async_runtime rt;
+static struct async_prof prof;
+static volatile uint32_t sink;
+static volatile int stop;
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    fprintf(stderr, "stack overflow: %p needs %d more bytes\n", s, locals_size);
+    exit(1);
+}
+
+static void burn(uint32_t n)
+{
+    uint32_t x = sink;
+    for (uint32_t i = 0; i < n; i++) {
+        x = x * 1103515245u + 12345u;
+    }
+    sink = x;
+}
+
+enum async parse(uint8_t *s)
+{
+    async_begin(s, uint8_t i);
+    for (l->i = 0; l->i < 4; l->i++) {
+        burn(5000);
+        async_yield;
+    }
+    async_end(s);
+}
+
+enum async checksum(uint8_t *s)
+{
+    async_begin(s, uint8_t i);
+    for (l->i = 0; l->i < 4; l->i++) {
+        burn(15000);
+        async_yield;
+    }
+    async_end(s);
+}
+
+enum async handle_request(uint8_t *s)
+{
+    async_begin(s);
+    await_call(parse(s));
+    await_call(checksum(s));
+    async_end(s);
+}
+
+enum async server(uint8_t *s, void *arg)
+{
+    (void)arg;
+    async_begin(s);
+    while (!stop) {
+        await_call(handle_request(s));
+    }
+    async_end(s);
+}
+
+enum async housekeeping(uint8_t *s, void *arg)
+{
+    (void)arg;
+    async_begin(s);
+    while (!stop) {
+        burn(2000);
+        async_yield;
+    }
+    async_end(s);
+}
+
+int main(int argc, char **argv)
+{
+    double secs = argc > 1 ? atof(argv[1]) : 2.0;
+    static struct async_task tasks[2];
+    static uint8_t stacks[2][STACK_LEN];
+
+    async_rt_init(&rt);
+    async_sched(&rt, &tasks[0], server, NULL, stacks[0], STACK_LEN);
+    async_sched(&rt, &tasks[1], housekeeping, NULL, stacks[1], STACK_LEN);
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (async_prof_start(&prof, &rt, 1000) < 0) {
+        perror("async_prof_start");
+        return 1;
+    }
+    do {
+        for (int i = 0; i < 1000; i++) {
+            async_next(&rt);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (now.tv_sec - start.tv_sec + (now.tv_nsec - start.tv_nsec) / 1e9 < secs);
+    async_prof_stop(&prof);
+    stop = 1;
+    async_run(&rt);
+
+    async_prof_dump(&prof, stdout);
+
+    // Samples per innermost function
+    const char *names[] = {"parse", "checksum", "housekeeping", "handle_request", "server"};
+    for (int n = 0; n < 5; n++) {
+        uint32_t count = 0;
+        for (uint32_t i = 0; i < prof.n; i++) {
+            struct async_prof_sample *smp = &prof.samples[i];
+            count += smp->depth && strcmp(__start_asyncc_funcs[smp->fid[smp->depth - 1]].name,
+                    names[n]) == 0;
+        }
+        fprintf(stderr, "%-15s %5u samples (innermost)\n", names[n], count);
+    }
+    return 0;
+}
@@ -0,0 +1,259 @@
+// @file ps.c
+// Live task listing over a Unix socket, and what it costs the loop
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Usage: ps [seconds per phase] [parked tasks]
+//
+// 500 tasks park on sockets that never get data, 5000 more (by default) park
+// with nothing to wake them, and 50 tasks stay busy, plus the async_ps_task()
+// listing them on a Unix socket.  The loop lag is measured for one phase
+// without queries and one where a client thread reads the full listing every
+// 10 ms.  Prints the head of one listing, the query times, and the loop lag
+// percentiles of both phases.  Fails if the listing task formatted more than
+// ASYNC_PS_ROWS rows in a resume, or made the worst lag more than
+// ASYNC_PS_LAG_RATIO times worse.
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+static uint32_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)(ts.tv_sec * 1000000u + ts.tv_nsec / 1000);
+}
+
+#define ASYNC_PS
+#define ASYNC_TRACE
+#define ASYNC_TRACK_EXTENT
+#define ASYNC_MONITOR
+#define ASYNC_NOW() now_us()
+#include "../asyncc_net.h"
+#include "../asyncc_ps.h"
+
+#define IDLE        500
+#define BUSY        50
+#define MAX_PARKED  20000
+#define STACK_LEN   64
+
+#ifndef ASYNC_PS_LAG_RATIO
+#define ASYNC_PS_LAG_RATIO  8
+#endif
+
+static struct async_runtime rt;
+static struct async_net net;
+static struct async_ps ps;
+static struct async_task tasks[IDLE + BUSY + 1 + MAX_PARKED];
+static uint8_t stacks[IDLE + BUSY + MAX_PARKED][STACK_LEN];
+static uint8_t ps_stack[ASYNC_PS_STACK];
+static char path[64];
+static volatile int querying, stop, client_done;
+static volatile uint32_t queries;
+static volatile uint32_t sink;
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    fprintf(stderr, "stack overflow: %p needs %d more bytes\n", s, locals_size);
+    exit(1);
+}
+
+enum async wait_for_data(uint8_t *s, void *arg)
+{
+    async_begin(s, long n, uint8_t buf[8]);
+    await_recv(&net, (int)(intptr_t)arg, l->buf, sizeof(l->buf), l->n);
+    async_end(s);
+}
+
+enum async parked(uint8_t *s, void *arg)
+{
+    (void)arg;
+    async_begin(s);
+    await_parked(&rt, stop);
+    async_end(s);
+}
+
+enum async busy(uint8_t *s, void *arg)
+{
+    (void)arg;
+    async_begin(s);
+    while (!stop) {
+        for (int i = 0; i < 300; i++) {
+            sink = sink * 1103515245u + 12345u;
+        }
+        async_yield;
+    }
+    async_end(s);
+}
+
+// Read one whole listing, returns its size
+static size_t query(char *out, size_t len)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+    size_t got = 0;
+    char buf[4096];
+    for (;;) {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n <= 0) {
+            break;
+        }
+        if (out && got + n < len) {
+            memcpy(out + got, buf, n);
+            out[got + n] = 0;
+        }
+        got += n;
+    }
+    close(fd);
+    return got;
+}
+
+static void *client(void *arg)
+{
+    (void)arg;
+    static char first[1 << 17];
+    uint32_t total = 0, worst = 0;
+    size_t size = 0;
+    struct timespec ts = {0, 10000000};
+    while (!querying) {
+        nanosleep(&ts, NULL);
+    }
+    while (querying) {
+        uint32_t start = now_us();
+        size = query(queries ? NULL : first, sizeof(first));
+        uint32_t t = now_us() - start;
+        total += t;
+        worst = t > worst ? t : worst;
+        queries++;
+        nanosleep(&ts, NULL);
+    }
+
+    // The header, a few rows, and one parked task
+    char *line = first;
+    for (int i = 0; line && i < 4; i++) {
+        char *end = strchr(line, '\n');
+        printf("%.*s\n", (int)(end - line), line);
+        line = end + 1;
+    }
+    line = strstr(first, " io ");
+    if (line) {
+        while (line > first && line[-1] != '\n') {
+            line--;
+        }
+        printf("%.*s\n", (int)(strchr(line, '\n') - line), line);
+    }
+    printf("%u queries of %zu bytes, %u us mean, %u us worst\n", queries, size,
+            total / (queries ? queries : 1), worst);
+    client_done = 1;
+    return NULL;
+}
+
+static void spin(void)
+{
+    for (int i = 0; i < 64; i++) {
+        async_next(&rt);
+    }
+    async_net_poll(&net, 0);
+}
+
+static uint32_t phase(const char *name, double secs)
+{
+    memset(rt.lag, 0, sizeof(rt.lag));
+    uint32_t start = now_us();
+    while (now_us() - start < secs * 1e6) {
+        spin();
+    }
+    printf("%-16s loop lag p50 < %u us, p99 < %u us, max < %u us\n", name,
+            async_lag_percentile(&rt, 50), async_lag_percentile(&rt, 99),
+            async_lag_percentile(&rt, 100));
+    return async_lag_percentile(&rt, 100);
+}
+
+int main(int argc, char **argv)
+{
+    double secs = argc > 1 ? atof(argv[1]) : 1.0;
+    int extra = argc > 2 ? atoi(argv[2]) : 5000;
+    extra = extra < 0 ? 0 : extra > MAX_PARKED ? MAX_PARKED : extra;
+    async_rt_init(&rt);
+    async_net_init(&net, &rt);
+
+    snprintf(path, sizeof(path), "/tmp/asyncc_ps_%d.sock", (int)getpid());
+    ps.net = &net;
+    ps.fd = async_ps_listen(path);
+    if (ps.fd < 0) {
+        perror(path);
+        return 1;
+    }
+    async_sched(&rt, &tasks[IDLE + BUSY], async_ps_task, &ps, ps_stack, sizeof(ps_stack));
+
+    for (int i = 0; i < IDLE; i++) {
+        int sv[2];
+        socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv);
+        async_sched(&rt, &tasks[i], wait_for_data, (void*)(intptr_t)sv[0], stacks[i], STACK_LEN);
+    }
+    for (int i = IDLE; i < IDLE + BUSY; i++) {
+        async_sched(&rt, &tasks[i], busy, NULL, stacks[i], STACK_LEN);
+    }
+    for (int i = IDLE + BUSY; i < IDLE + BUSY + extra; i++) {
+        async_sched(&rt, &tasks[i + 1], parked, NULL, stacks[i], STACK_LEN);
+    }
+
+    pthread_t th;
+    pthread_create(&th, NULL, client, NULL);
+    uint32_t quiet = phase("no queries:", secs);
+    uint64_t resumes = tasks[IDLE + BUSY].resumes;
+    querying = 1;
+    uint32_t loaded = phase("querying:", secs);
+    querying = 0;
+    while (!client_done) {
+        spin();         // Let the last listing finish
+    }
+    pthread_join(th, NULL);
+    unlink(path);
+
+    // Every batch of rows is its own resume
+    uint32_t rows = IDLE + BUSY + extra + 1;
+    resumes = tasks[IDLE + BUSY].resumes - resumes;
+    printf("%.0f resumes per listing of %u rows\n",
+            (double)resumes / (queries ? queries : 1), rows);
+    if (resumes < (uint64_t)queries * (rows / ASYNC_PS_ROWS)) {
+        printf("FAIL: fewer than one resume per %d rows\n", ASYNC_PS_ROWS);
+        return 1;
+    }
+    if (loaded > quiet * ASYNC_PS_LAG_RATIO) {
+        printf("FAIL: the listing raised the worst loop lag from < %u us to < %u us\n",
+                quiet, loaded);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,194 @@
+// @file shm_chan.c
+// Shared-memory channel vs a Unix socket between two processes
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Usage: shm_chan [messages] [message size] [ring size]
+//
+// The parent process sends the messages (1M of 64 bytes by default) and a
+// forked child receives and checks them, each side as one task on its own
+// runtime and epoll reactor.  The same stream is then sent over a SEQPACKET
+// socketpair with await_send()/await_recv() for comparison.  Reports messages
+// per second, and for the channel how often each side had to wait and how
+// many eventfd kicks it made (the only syscalls on the channel path).
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "../asyncc_shm.h"
+
+#define STACK_LEN   128
+#define MAX_MSG     4096
+
+struct stats {
+    uint32_t waits[2];
+    uint32_t kicks[2];
+    uint64_t errors;
+};
+
+static struct async_runtime rt;
+static struct async_net net;
+static struct async_chan ch;
+static struct stats *stats;     // Shared with the child
+static uint64_t count;
+static uint32_t size;
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    fprintf(stderr, "stack overflow: %p needs %d more bytes\n", s, locals_size);
+    exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+enum async chan_producer(uint8_t *s, void *arg)
+{
+    (void)arg;
+    async_begin(s, uint64_t i, uint8_t *p);
+    for (l->i = 0; l->i < count; l->i++) {
+        await_chan_reserve(&net, &ch, l->p, size);
+        if (!l->p) {
+            perror("chan wait");
+            exit(1);
+        }
+        memcpy(l->p, &l->i, sizeof(l->i));
+        async_chan_commit(&ch);
+    }
+    async_end(s);
+}
+
+enum async chan_consumer(uint8_t *s, void *arg)
+{
+    (void)arg;
+    async_begin(s, uint64_t i, uint8_t *p, uint32_t n);
+    for (l->i = 0; l->i < count; l->i++) {
+        await_chan_recv(&net, &ch, l->p, l->n);
+        if (!l->p) {
+            perror("chan wait");
+            exit(1);
+        }
+        stats->errors += l->n != size || memcmp(l->p, &l->i, sizeof(l->i)) != 0;
+        async_chan_release(&ch);
+    }
+    async_end(s);
+}
+
+enum async sock_producer(uint8_t *s, void *arg)
+{
+    async_begin(s, uint64_t i, long n, uint8_t buf[MAX_MSG]);
+    for (l->i = 0; l->i < count; l->i++) {
+        memcpy(l->buf, &l->i, sizeof(l->i));
+        await_send(&net, (int)(intptr_t)arg, l->buf, size, l->n);
+        if (l->n != (long)size) {
+            perror("send");
+            exit(1);
+        }
+    }
+    async_end(s);
+}
+
+enum async sock_consumer(uint8_t *s, void *arg)
+{
+    async_begin(s, uint64_t i, long n, uint8_t buf[MAX_MSG]);
+    for (l->i = 0; l->i < count; l->i++) {
+        await_recv(&net, (int)(intptr_t)arg, l->buf, MAX_MSG, l->n);
+        stats->errors += l->n != (long)size || memcmp(l->buf, &l->i, sizeof(l->i)) != 0;
+    }
+    async_end(s);
+}
+
+// Run one task to completion on a fresh runtime and reactor
+static void run_task(async_task_fn fn, void *arg)
+{
+    static struct async_task task;
+    static uint8_t stack[STACK_LEN + MAX_MSG];
+    async_rt_init(&rt);
+    async_net_init(&net, &rt);
+    async_sched(&rt, &task, fn, arg, stack, sizeof(stack));
+    async_net_run(&net);
+    async_net_close(&net);
+}
+
+// Run producer here and consumer in a child, returns messages per second
+static double run(async_task_fn producer, async_task_fn consumer, void *parg, void *carg)
+{
+    uint64_t start = now_ns();
+    pid_t pid = fork();
+    if (pid == 0) {
+        run_task(consumer, carg);
+        stats->waits[1] = ch.waits;
+        stats->kicks[1] = ch.kicks;
+        _exit(0);
+    }
+    run_task(producer, parg);
+    waitpid(pid, NULL, 0);
+    stats->waits[0] = ch.waits;
+    stats->kicks[0] = ch.kicks;
+    return count / ((double)(now_ns() - start) / 1e9);
+}
+
+int main(int argc, char **argv)
+{
+    count = argc > 1 ? strtoull(argv[1], NULL, 0) : 1000000;
+    size = argc > 2 ? (uint32_t)atoi(argv[2]) : 64;
+    uint32_t cap = argc > 3 ? (uint32_t)atoi(argv[3]) : 1 << 20;
+    if (size < sizeof(uint64_t) || size > MAX_MSG || size > cap / 2 - 8) {
+        fprintf(stderr, "message size must be 8..%d and fit half the ring\n", MAX_MSG);
+        return 1;
+    }
+
+    stats = mmap(NULL, sizeof(*stats), PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (async_chan_create(&ch, cap) < 0) {
+        perror("async_chan_create");
+        return 1;
+    }
+
+    double chan = run(chan_producer, chan_consumer, NULL, NULL);
+    printf("channel: %9.0f msgs/s (%.0f MB/s), producer waited %u times and "
+            "kicked %u, consumer waited %u times and kicked %u\n", chan,
+            chan * size / 1e6, stats->waits[0], stats->kicks[0], stats->waits[1],
+            stats->kicks[1]);
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("socketpair");
+        return 1;
+    }
+    double sock = run(sock_producer, sock_consumer, (void*)(intptr_t)sv[0],
+            (void*)(intptr_t)sv[1]);
+    printf("socket:  %9.0f msgs/s (%.0f MB/s)\n", sock, sock * size / 1e6);
+
+    if (stats->errors) {
+        printf("%llu messages were corrupted\n", (unsigned long long)stats->errors);
+        return 1;
+    }
+    return 0;
+}
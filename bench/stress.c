@@ -0,0 +1,498 @@
+// @file stress.c
+// Random call trees checked against a model of the stack index
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Usage: stress [trees] [seed]
+//        stress -f input          (replay one input, or run under afl-fuzz)
+//
+// Every tree is a random mix of yields, polls, nested calls, async_alloca(),
+// early exits, and stack overflows (the stack length is random too), run to
+// completion.  The harness keeps its own model of where each frame should sit,
+// built from the frame sizes alone, and checks IDX against it before and after
+// every call and every resume, so any path that pushes or pops the wrong
+// amount is caught where it happens instead of showing up later as corrupted
+// locals.
+// Each frame also keeps a tag that is re-checked after every suspension, and
+// the bytes past the end of the stack must be left alone.  Siblings are
+// awaited back to back on the same stack, right where the last one finished,
+// exited, or overflowed, and every new call must really start (run its first
+// statement) unless its frame didn't fit.  One kind of node keeps its locals
+// in registers (ASYNC_HOT) and checks them after every suspension.
+//
+// Without arguments this is a throughput test for the hot macros (resumes and
+// calls per second).  Build with -DASYNC_FUZZ for libFuzzer, where the input
+// bytes drive every choice:
+//
+//   clang -O1 -g -DASYNC_FUZZ -fsanitize=fuzzer,address bench/stress.c
+//
+// Try it with -DASYNC_TRACK_EXTENT as well.  With -DASYNC_DENSE_SPOTS it also
+// checks that two awaits on one line get spots of their own, which
+// async_spot_line() maps back to that line.
+//
+// With -DASYNC_STRESS_MOVE the suspended stack is moved after every resume
+// (see asyncc_reloc.h): into the other of two arenas, behind a hole left by
+// a finished stack and sometimes a pinned one, and the arena is compacted.
+// The frame tags catch a stack that resumes wrong after a move, and a move
+// must be refused as pinned while a frame holds an async_alloca() pointer.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef ASYNC_STRESS_MOVE
+#include "../asyncc_reloc.h"
+#else
+#include "../asyncc.h"
+#endif
+
+#ifdef LIVE_DANGEROUSLY
+#error "the stress test needs the stack bounds checks"
+#endif
+
+#define MAX_DEPTH   12
+#define MAX_NODES   4096
+#define STACK_LEN   256
+#define GUARD       32
+
+enum kind {SMALL, BIG, LEAF, VAR, HOT};
+
+static const uint8_t *in;       // Fuzz input (NULL to use the PRNG)
+static size_t in_len, in_pos;
+static uint64_t rng, tree;
+static uint32_t nodes;
+static uint64_t resumes, calls, errors, begun;
+static uint32_t pinning;        // Live frames that point into the stack
+static uint8_t pending;         // The next call() is a new call
+
+static uint8_t pick(void)
+{
+    if (in) {
+        return in_pos < in_len ? in[in_pos++] : 0;
+    }
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return (uint8_t)(rng >> 32);
+}
+
+static void fail(const char *what, int line)
+{
+    fprintf(stderr, "stress.c:%d: expected %s (tree %llu)\n", line, what,
+            (unsigned long long)tree);
+    abort();
+}
+
+#define expect(c) if (!(c)) fail(#c, __LINE__)
+
+// Every frame gets a tag derived from its depth and model position
+#define TAG(depth, at) ((uint16_t)((at) * 31u + (depth)))
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    (void)s;
+    (void)locals_size;
+    errors++;
+}
+
+// Start a new call from the await that follows
+static void new_call(void)
+{
+    pending = 1;
+    nodes++;
+}
+
+static enum async call(uint8_t *s, uint8_t kind, uint8_t depth, uint16_t at);
+
+// Children are only called while under the depth and size limits
+static uint8_t pick_child(uint8_t depth)
+{
+    if (depth + 1 >= MAX_DEPTH || nodes >= MAX_NODES) {
+        return LEAF;
+    }
+    return pick() % 5;
+}
+
+static enum async node_small(uint8_t *s, uint8_t depth, uint16_t at)
+{
+    async_begin(s, uint16_t tag, uint8_t steps, uint8_t op);
+    l->tag = TAG(depth, at);
+    begun++;
+    for (l->steps = pick() % 4 + 1; l->steps; l->steps--) {
+        l->op = pick() % 8;
+        if (l->op < 3) {
+            async_yield;
+        } else if (l->op < 6) {
+            l->op = pick_child(depth);
+            new_call();
+            await_call(call(s, l->op, depth + 1, at + a_frame));
+        } else if (l->op == 6 && pick() < 64) {
+            async_exit;
+        } else {
+            await(pick() < 192);
+        }
+        expect(l->tag == TAG(depth, at));
+    }
+    async_end(s);
+}
+
+static enum async node_big(uint8_t *s, uint8_t depth, uint16_t at)
+{
+    async_begin(s, uint16_t tag, uint8_t steps, uint8_t op, uint8_t pad[40]);
+    l->tag = TAG(depth, at);
+    begun++;
+    memset(l->pad, (uint8_t)l->tag, sizeof(l->pad));
+    for (l->steps = pick() % 4 + 1; l->steps; l->steps--) {
+        l->op = pick() % 8;
+        if (l->op < 3) {
+            async_yield;
+        } else if (l->op < 6) {
+            l->op = pick_child(depth);
+            new_call();
+            await_call(call(s, l->op, depth + 1, at + a_frame));
+        } else if (l->op == 6 && pick() < 64) {
+            async_exit;
+        } else {
+            await(pick() < 192);
+        }
+        expect(l->tag == TAG(depth, at));
+        expect(l->pad[0] == (uint8_t)l->tag && l->pad[39] == (uint8_t)l->tag);
+    }
+    async_end(s);
+}
+
+static enum async node_leaf(uint8_t *s, uint8_t depth, uint16_t at)
+{
+    async_inline_begin(s, uint16_t tag, uint8_t steps);
+    l->tag = TAG(depth, at);
+    begun++;
+    for (l->steps = pick() % 3; l->steps; l->steps--) {
+        if (pick() & 1) {
+            async_yield;
+        } else {
+            await(pick() < 192);
+        }
+        expect(l->tag == TAG(depth, at));
+    }
+    async_inline_end(s);
+}
+
+// Grows its frame by a random amount, children go above that
+static enum async node_var(uint8_t *s, uint8_t depth, uint16_t at)
+{
+    async_alloca_begin(s, uint16_t tag, uint8_t steps, uint8_t op, uint8_t n,
+            uint8_t *buf);
+    l->tag = TAG(depth, at);
+    begun++;
+    l->n = pick() % 32;
+    async_alloca(l->buf, l->n);
+    if (!l->buf) {
+        async_exit;
+    }
+    memset(l->buf, (uint8_t)l->tag, l->n);
+    pinning += l->n != 0;
+    for (l->steps = pick() % 4 + 1; l->steps; l->steps--) {
+        if (pick() & 1) {
+            async_yield;
+        } else {
+            l->op = pick_child(depth);
+            new_call();
+            await_call(call(s, l->op, depth + 1, at + a_frame + ASYNC_ALLOCA_SIZE(l->n)));
+        }
+        expect(l->tag == TAG(depth, at));
+        expect(!l->n || (l->buf[0] == (uint8_t)l->tag && l->buf[l->n - 1] == (uint8_t)l->tag));
+    }
+    pinning -= l->n != 0;
+    async_end(s);
+}
+
+// Keeps its loop counter and running sum in registers between suspensions
+// (ASYNC_HOT), so a sum that comes back wrong means a missed write-back
+#undef ASYNC_HOT
+#define ASYNC_HOT(X) X(i) X(sum)
+static enum async node_hot(uint8_t *s, uint8_t depth, uint16_t at)
+{
+    async_begin(s, uint16_t tag, uint8_t steps, uint8_t op, uint8_t i,
+            uint16_t sum);
+    l->tag = TAG(depth, at);
+    begun++;
+    l->steps = pick() % 8 + 1;
+    for (i = 0, sum = 0; i < l->steps; i++) {
+        sum += i + 1;
+        if (pick() & 1) {
+            async_yield;
+        } else if (pick() & 1) {
+            await(pick() < 192);
+        } else {
+            l->op = pick_child(depth);
+            new_call();
+            await_call(call(s, l->op, depth + 1, at + a_frame));
+        }
+        expect(l->tag == TAG(depth, at));
+        expect(sum == (i + 1) * (i + 2) / 2);
+    }
+    async_end(s);
+}
+#undef ASYNC_HOT
+#define ASYNC_HOT(X)
+
+// Call a node whose frame the model puts at "at", and check that the index is
+// the same on the way out (whether it finished, suspended, exited, or failed)
+static enum async call(uint8_t *s, uint8_t kind, uint8_t depth, uint16_t at)
+{
+    enum async r;
+    uint8_t fresh = pending;
+    uint64_t was_begun = begun;
+    pending = 0;
+    expect(IDX(s) == at);
+    switch (kind) {
+    case SMALL: r = node_small(s, depth, at); break;
+    case BIG:   r = node_big(s, depth, at); break;
+    case VAR:   r = node_var(s, depth, at); break;
+    case HOT:   r = node_hot(s, depth, at); break;
+    default:    r = node_leaf(s, depth, at); break;
+    }
+    expect(IDX(s) == at);
+    expect(!fresh || begun > was_begun || r == ASYNC_ERR);
+    calls++;
+    return r;
+}
+
+#ifdef ASYNC_STRESS_MOVE
+
+#define ARENA   (3 * STACK_LEN + GUARD)
+
+static uint8_t arenas[2][ARENA];
+static uint64_t moves, pinned, false_pins;
+
+// A stack that holds a pointer to itself, which compaction must leave alone
+static uint8_t *pinned_stack(struct async_arena *a, uint16_t len)
+{
+    uint8_t *p = async_arena_alloc(a, len);
+    async_init(p, len);
+    memcpy(p + ASYNC_HDR_SIZE + 2, &p, sizeof(p));
+#ifdef ASYNC_TRACK_EXTENT
+    EXT(p) = ASYNC_HDR_SIZE + 2 + sizeof(p);
+#endif
+    return p;
+}
+
+// Move suspended task t into the other arena and compact it, then put a guard
+// after the stack wherever it ended up
+static void move_tree(struct async_task *t)
+{
+    uint16_t len = MAX(t->s);
+    uint8_t *other = arenas[t->s < arenas[1]];
+    struct async_arena a;
+    struct async_task p = {0};
+    struct async_task *live[2];
+    uint16_t n = 0;
+
+    async_arena_init(&a, other, ARENA - GUARD);
+    // A finished stack, and maybe a pinned one (even sizes keep the headers
+    // aligned)
+    async_arena_alloc(&a, 2 + 2 * (pick() % (STACK_LEN / 2)));
+    if (pick() & 1) {
+        p.s = pinned_stack(&a, ASYNC_HDR_SIZE + 2 + sizeof(void*) + 2 * (pick() % 32));
+        p.state = ASYNC_TASK_PARKED;
+        live[n++] = &p;
+    }
+    uint8_t *dst = async_arena_alloc(&a, len);
+    enum async_reloc r = async_task_move(t, dst, len);
+    if (pinning) {
+        expect(r == ASYNC_RELOC_PINNED);
+    }
+    if (r == ASYNC_RELOC_PINNED) {
+        pinned++;
+        false_pins += !pinning;
+        return;
+    }
+    expect(r == ASYNC_RELOC_OK && t->s == dst);
+    moves++;
+
+    // The pinned stack stays, the tree slides down to it (or to the base)
+    uint8_t *p_was = p.s;
+    int stuck = async_stack_pinned(t->s);
+    live[n++] = t;
+    async_arena_compact(&a, live, n);
+    expect(p.s == p_was);
+    expect(t->s == (stuck ? dst : p.s ? p.s + MAX(p.s) : other));
+    expect(MAX(t->s) == len);
+    memset(t->s + len, 0xA5, GUARD);
+}
+
+static void run_tree(void)
+{
+    static uint8_t guard[GUARD];
+    struct async_task t = {0};
+    uint16_t len = ASYNC_HDR_SIZE + 2 + pick() % (STACK_LEN - ASYNC_HDR_SIZE - 2);
+    uint8_t kind = pick() % 2;
+
+    memset(guard, 0xA5, sizeof(guard));
+    t.s = arenas[0];
+    t.state = ASYNC_TASK_PARKED;
+    async_init(t.s, len);
+    memset(t.s + len, 0xA5, GUARD);
+    nodes = 1;
+    pending = 1;
+    pinning = 0;
+    while (call(t.s, kind, 0, ASYNC_HDR_SIZE) == ASYNC_CONT) {
+        resumes++;
+        expect(memcmp(t.s + len, guard, GUARD) == 0);
+
+        // A running task, or a length below what is live, can't be moved
+        t.state = ASYNC_TASK_RUNNING;
+        expect(async_task_move(&t, arenas[t.s < arenas[1]], len) == ASYNC_RELOC_PINNED);
+        t.state = ASYNC_TASK_PARKED;
+        expect(async_relocate(t.s, async_stack_used(t.s) - 1, t.s) == ASYNC_RELOC_NOSPACE);
+        move_tree(&t);
+    }
+    resumes++;
+    expect(pinning == 0);
+    expect(memcmp(t.s + len, guard, GUARD) == 0);
+}
+
+#else
+
+static void run_tree(void)
+{
+    static uint8_t stack[STACK_LEN + GUARD];
+    static uint8_t guard[STACK_LEN + GUARD];
+    uint16_t len = ASYNC_HDR_SIZE + 2 + pick() % (STACK_LEN - ASYNC_HDR_SIZE - 2);
+    uint8_t kind = pick() % 2;
+
+    memset(guard, 0xA5, sizeof(guard));
+    memcpy(stack + len, guard, sizeof(stack) - len);
+    async_init(stack, len);
+    nodes = 1;
+    pending = 1;
+    while (call(stack, kind, 0, ASYNC_HDR_SIZE) == ASYNC_CONT) {
+        resumes++;
+    }
+    resumes++;
+    expect(memcmp(stack + len, guard, sizeof(stack) - len) == 0);
+}
+
+#endif
+
+#ifdef ASYNC_DENSE_SPOTS
+
+static uint16_t spots[2], spots_line;
+
+static enum async two_on_a_line(uint8_t *s)
+{
+    async_begin(s);
+    async_yield; spots[0] = l->spot; async_yield; spots[1] = l->spot; spots_line = __LINE__;
+    async_end(s);
+}
+
+// Two resume points on one line must still get spots of their own, and both
+// must map back to that line
+static void check_dense_spots(void)
+{
+    static uint8_t stack[ASYNC_HDR_SIZE + 16];
+
+    async_init(stack, sizeof(stack));
+    while (two_on_a_line(stack) == ASYNC_CONT) {
+    }
+    expect(spots[0] > ASYNC_DONE && spots[1] > ASYNC_DONE);
+    expect(spots[0] != spots[1]);
+#ifndef ASYNC_NO_SPOT_TABLE
+    expect(async_spot_line("two_on_a_line", spots[0]) == spots_line);
+    expect(async_spot_line("two_on_a_line", spots[1]) == spots_line);
+#endif
+}
+
+#endif
+
+#ifdef ASYNC_FUZZ
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    in = data;
+    in_len = size;
+    in_pos = 0;
+    run_tree();
+    return 0;
+}
+
+#else
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Read a whole input file (AFL style replay)
+static int replay(const char *path)
+{
+    static uint8_t buf[1 << 16];
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    in_len = fread(buf, 1, sizeof(buf), f);
+    fclose(f);
+    in = buf;
+    run_tree();
+    printf("ok: %llu resumes, %llu calls, %llu overflows\n",
+            (unsigned long long)resumes, (unsigned long long)calls,
+            (unsigned long long)errors);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 2 && strcmp(argv[1], "-f") == 0) {
+        return replay(argv[2]);
+    }
+    uint64_t trees = argc > 1 ? strtoull(argv[1], NULL, 0) : 200000;
+    uint64_t seed = argc > 2 ? strtoull(argv[2], NULL, 0) : 1;
+
+#ifdef ASYNC_DENSE_SPOTS
+    check_dense_spots();
+#endif
+    uint64_t start = now_ns();
+    for (tree = 0; tree < trees; tree++) {
+        // Each tree has its own seed, so a failing tree can be found again
+        rng = (seed + tree) * 0x9E3779B97F4A7C15ull | 1;
+        run_tree();
+    }
+    double secs = (double)(now_ns() - start) / 1e9;
+
+    printf("%llu trees: %llu resumes, %llu calls, %llu overflows\n",
+            (unsigned long long)trees, (unsigned long long)resumes,
+            (unsigned long long)calls, (unsigned long long)errors);
+    printf("%.1f M resumes/s, %.1f M calls/s (%.2f ns/call)\n",
+            resumes / secs / 1e6, calls / secs / 1e6, secs * 1e9 / calls);
+#ifdef ASYNC_STRESS_MOVE
+    printf("%llu moves, %llu refused as pinned (%llu with no async_alloca() "
+            "pointer live)\n", (unsigned long long)moves,
+            (unsigned long long)pinned, (unsigned long long)false_pins);
+#endif
+    return 0;
+}
+
+#endif
@@ -0,0 +1,214 @@
+// @file sync.c
+// Shared future against polling a flag, and a read-mostly rwlock
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Usage: sync [waiting tasks] [rwlock resumes]
+//
+// Fan-in: the given number of tasks (1000 by default) all need a config that
+// takes 100 resumes to load.  With await_once() one task loads it and the
+// rest park on the future; with a plain flag the rest await it, and so get
+// resumed on every pass until it is set.  Prints the resumes each way.
+//
+// rwlock: 64 readers check a table that 2 writers rebuild entry by entry,
+// yielding in between (inside the lock), and everyone yields inside and
+// outside the lock.  Prints reads and writes done in the given number of
+// resumes (4M by default), the longest a writer waited for the lock, and
+// how many torn tables the readers saw (must be 0).  Then again with writers
+// that lock again as soon as they unlock, where every reader must still get
+// to read in the second half of the run.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../asyncc_sync.h"
+
+#define STACK_LEN   64
+#define TABLE       16
+#define READERS     64
+#define WRITERS     2
+
+static struct async_runtime rt;
+static struct async_task *tasks;
+static uint8_t (*stacks)[STACK_LEN];
+
+static struct async_future cfg;
+static uint8_t cfg_flag;
+static uint32_t loads;
+
+static struct async_rwlock lock;
+static uint32_t table[TABLE];
+static uint64_t reads, writes, torn, resumes, max_wait;
+static uint64_t reader_reads[READERS];
+static uint8_t writer_pause;
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    fprintf(stderr, "stack overflow: %p needs %d more bytes\n", s, locals_size);
+    exit(1);
+}
+
+enum async load_config(uint8_t *s)
+{
+    async_begin(s, uint8_t i);
+    loads++;
+    for (l->i = 0; l->i < 100; l->i++) {
+        async_yield;
+    }
+    async_end(s);
+}
+
+enum async user_once(uint8_t *s, void *arg)
+{
+    (void)arg;
+    async_begin(s);
+    await_once(s, &cfg, load_config(s));
+    async_end(s);
+}
+
+enum async user_flag(uint8_t *s, void *arg)
+{
+    (void)arg;
+    async_begin(s);
+    if (!cfg_flag) {
+        cfg_flag = 1;
+        await_call(load_config(s));
+        cfg_flag = 2;
+    }
+    await(cfg_flag == 2);
+    async_end(s);
+}
+
+static uint64_t fan_in(async_task_fn fn, int n)
+{
+    uint64_t count = 0;
+    loads = 0;
+    async_rt_init(&rt);
+    async_future_init(&cfg, &rt);
+    cfg_flag = 0;
+    memset(stacks, 0, (size_t)n * STACK_LEN);
+    for (int i = 0; i < n; i++) {
+        async_sched(&rt, &tasks[i], fn, NULL, stacks[i], STACK_LEN);
+    }
+    while (async_next(&rt)) {
+        count++;
+    }
+    return count;
+}
+
+enum async reader(uint8_t *s, void *arg)
+{
+    async_begin(s, uint8_t i);
+    for (;;) {
+        await_rdlock(s, &lock);
+        for (l->i = 1; l->i < TABLE; l->i++) {
+            torn += table[l->i] != table[0];
+            if (l->i % 4 == 0) {
+                async_yield;
+            }
+        }
+        reads++;
+        reader_reads[(intptr_t)arg]++;
+        async_rdunlock(&lock);
+        async_yield;
+    }
+    async_end(s);
+}
+
+enum async writer(uint8_t *s, void *arg)
+{
+    (void)arg;
+    async_begin(s, uint8_t i, uint64_t since);
+    for (;;) {
+        for (l->i = 0; l->i < writer_pause; l->i++) {
+            async_yield;
+        }
+        l->since = resumes;
+        await_wrlock(s, &lock);
+        max_wait = resumes - l->since > max_wait ? resumes - l->since : max_wait;
+        for (l->i = 0; l->i < TABLE; l->i++) {
+            table[l->i]++;
+            async_yield;
+        }
+        writes++;
+        async_wrunlock(&lock);
+    }
+    async_end(s);
+}
+
+// Run the readers and writers for limit resumes, returns how many readers
+// didn't read in the second half
+static uint64_t rwlock(int ntasks, uint64_t limit, uint8_t pause, const char *name)
+{
+    memset(stacks, 0, (size_t)ntasks * STACK_LEN);
+    memset(reader_reads, 0, sizeof(reader_reads));
+    reads = writes = max_wait = 0;
+    writer_pause = pause;
+    async_rt_init(&rt);
+    async_rwlock_init(&lock, &rt);
+    for (int i = 0; i < READERS; i++) {
+        async_sched(&rt, &tasks[i], reader, (void*)(intptr_t)i, stacks[i], STACK_LEN);
+    }
+    for (int i = READERS; i < READERS + WRITERS; i++) {
+        async_sched(&rt, &tasks[i], writer, NULL, stacks[i], STACK_LEN);
+    }
+    uint64_t half[READERS];
+    for (resumes = 0; resumes < limit; resumes++) {
+        if (resumes == limit / 2) {
+            memcpy(half, reader_reads, sizeof(half));
+        }
+        async_next(&rt);
+    }
+
+    uint64_t starved = 0;
+    for (int i = 0; i < READERS; i++) {
+        starved += reader_reads[i] == half[i];
+    }
+    printf("%-14s %llu reads, %llu writes, writer waited up to %llu resumes, "
+            "%llu torn reads\n", name, (unsigned long long)reads,
+            (unsigned long long)writes, (unsigned long long)max_wait,
+            (unsigned long long)torn);
+    return starved;
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 1000;
+    uint64_t limit = argc > 2 ? strtoull(argv[2], NULL, 0) : 4000000;
+    int ntasks = n > READERS + WRITERS ? n : READERS + WRITERS;
+    tasks = calloc(ntasks, sizeof(*tasks));
+    stacks = calloc(ntasks, STACK_LEN);
+
+    uint64_t once = fan_in(user_once, n);
+    printf("%d tasks, await_once:  %8llu resumes (%u load)\n", n,
+            (unsigned long long)once, loads);
+    uint64_t flag = fan_in(user_flag, n);
+    printf("%d tasks, flag polled: %8llu resumes (%u load)\n", n,
+            (unsigned long long)flag, loads);
+
+    uint64_t starved = rwlock(ntasks, limit, 200, "rwlock:");
+    starved += rwlock(ntasks, limit, 0, "busy writers:");
+    if (starved) {
+        printf("%llu readers starved\n", (unsigned long long)starved);
+    }
+    return torn != 0 || starved != 0;
+}
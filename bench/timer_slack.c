@@ -0,0 +1,174 @@
+// @file timer_slack.c
+// Loop wakeups of many periodic sleepers, with and without timer slack
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Usage: timer_slack [tasks] [seconds per run]
+//
+// The given number of tasks (2000 by default) each sleep for a period of their
+// own between 90 and 110 ms, in a loop.  A ticker thread drives ASYNC_TICK
+// every millisecond, and the runtime thread blocks on a semaphore that the
+// inbox kick posts, so every kick is a wakeup of the loop.  The run is
+// repeated with no slack, then with 1%, 5%, and 10% of each period as slack,
+// reporting loop wakeups per second and how late the sleeps ended.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "../asyncc_timer.h"
+
+#define STACK_LEN   96
+#define MAX_SAMPLES (1 << 18)
+
+static struct async_timers timers;
+static struct async_runtime rt;
+static struct async_inbox ib;
+static sem_t sem;
+static atomic_int stop;
+static struct async_task *tasks;
+static uint8_t (*stacks)[STACK_LEN];
+static uint32_t *periods;
+static uint32_t slack_pct;
+static uint32_t late[MAX_SAMPLES], nlate;
+static uint64_t loop_wakeups, fires;
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    fprintf(stderr, "stack overflow: %p needs %d more bytes\n", s, locals_size);
+    exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void kick(void *arg)
+{
+    (void)arg;
+    sem_post(&sem);
+}
+
+enum async periodic(uint8_t *s, void *arg)
+{
+    (void)arg;
+    async_begin(s, uint64_t start, uint32_t ms);
+    l->ms = periods[rt.current - tasks];
+
+    while (!atomic_load_explicit(&stop, memory_order_relaxed)) {
+        l->start = now_ns();
+        await_sleep_slack(s, &ib, l->ms, l->ms * slack_pct / 100);
+        int64_t over = (int64_t)(now_ns() - l->start) - l->ms * 1000000ll;
+        if (nlate < MAX_SAMPLES) {
+            late[nlate++] = over > 0 ? (uint32_t)(over / 1000) : 0;
+        }
+        fires++;
+    }
+
+    async_end(s);
+}
+
+static void *run_loop(void *arg)
+{
+    (void)arg;
+    while (!atomic_load(&stop)) {
+        async_inbox_drain(&ib);
+        async_run(&rt);
+        sem_wait(&sem);
+        loop_wakeups++;
+    }
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(int n, double secs)
+{
+    async_timers_init(&timers);
+    async_rt_init(&rt);
+    async_inbox_init(&ib, &rt, &timers, kick, NULL);
+    sem_init(&sem, 0, 0);
+    atomic_store(&stop, 0);
+    loop_wakeups = fires = nlate = 0;
+    // Sleeps left over from the last run are abandoned leaves, clear them too
+    memset(stacks, 0, (size_t)n * STACK_LEN);
+    for (int i = 0; i < n; i++) {
+        async_sched(&rt, &tasks[i], periodic, NULL, stacks[i], STACK_LEN);
+    }
+    pthread_t th;
+    pthread_create(&th, NULL, run_loop, NULL);
+
+    // The ticker runs on this thread, on absolute 1 ms deadlines
+    uint64_t ticks = secs * 1000;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (uint64_t i = 0; i < ticks; i++) {
+        next.tv_nsec += 1000000;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        ASYNC_TICK(&timers, 1);
+    }
+
+    atomic_store(&stop, 1);
+    sem_post(&sem);
+    pthread_join(th, NULL);
+    sem_destroy(&sem);
+
+    qsort(late, nlate, sizeof(*late), cmp_u32);
+    printf("slack %3u%%: %6.0f loop wakeups/s, %6.0f timers/s (%5.1f per wakeup), "
+            "late p50 %5u us p99 %6u us\n", slack_pct, loop_wakeups / secs,
+            fires / secs, loop_wakeups ? (double)fires / loop_wakeups : 0.0,
+            nlate ? late[nlate / 2] : 0, nlate ? late[nlate * 99 / 100] : 0);
+}
+
+int main(int argc, char **argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 2000;
+    double secs = argc > 2 ? atof(argv[2]) : 2.0;
+
+    tasks = calloc(n, sizeof(*tasks));
+    stacks = calloc(n, STACK_LEN);
+    periods = malloc(n * sizeof(*periods));
+    srand(1);
+    for (int i = 0; i < n; i++) {
+        periods[i] = 90 + rand() % 21;
+    }
+
+    static const uint32_t pcts[] = {0, 1, 5, 10};
+    for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++) {
+        slack_pct = pcts[i];
+        run(n, secs);
+    }
+    return 0;
+}
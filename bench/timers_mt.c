@@ -0,0 +1,196 @@
+// @file timers_mt.c
+// Scaling of one timer service across several runtime threads
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Usage: timers_mt [tasks per runtime] [seconds per run]
+//
+// One ticker thread drives ASYNC_TICK every millisecond, and 1, 2, 4, then 8
+// runtime threads each run the given number of tasks (256 by default) that
+// sleep 1-10 ms in a loop.  Idle runtime threads block on a semaphore that
+// the inbox kick posts.  For every runtime count this reports the wakeups per
+// second, the cost of a tick (mean and worst), and how late the wakeups were
+// against the requested sleep (tick granularity included).
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "../asyncc_timer.h"
+
+#define STACK_LEN   96
+#define MAX_SAMPLES (1 << 17)
+
+struct runner {
+    pthread_t thread;
+    struct async_runtime rt;
+    struct async_inbox ib;
+    sem_t kick;
+    struct async_task *tasks;
+    uint8_t (*stacks)[STACK_LEN];
+    uint32_t *late;         // Lateness samples (us)
+    uint32_t nlate;
+    uint64_t wakeups;
+};
+
+static struct async_timers timers;
+static atomic_int stop;
+static int ntasks;
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    fprintf(stderr, "stack overflow: %p needs %d more bytes\n", s, locals_size);
+    exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void kick(void *arg)
+{
+    sem_post(&((struct runner*)arg)->kick);
+}
+
+enum async sleeper(uint8_t *s, void *arg)
+{
+    struct runner *r = arg;
+    async_begin(s, uint64_t start, uint32_t ms);
+    l->ms = 1 + (uint32_t)(r->rt.current - r->tasks) % 10;
+
+    for (;;) {
+        l->start = now_ns();
+        await_sleep(s, &r->ib, l->ms);
+        // Catch-up ticks after a slow one can fire slightly early
+        int64_t late = (int64_t)(now_ns() - l->start) - l->ms * 1000000ll;
+        if (r->nlate < MAX_SAMPLES) {
+            r->late[r->nlate++] = late > 0 ? (uint32_t)(late / 1000) : 0;
+        }
+        r->wakeups++;
+    }
+
+    async_end(s);
+}
+
+static void *run_loop(void *arg)
+{
+    struct runner *r = arg;
+    while (!atomic_load(&stop)) {
+        async_inbox_drain(&r->ib);
+        async_run(&r->rt);
+        sem_wait(&r->kick);
+    }
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run(int nrt, double secs)
+{
+    struct runner *rs = calloc(nrt, sizeof(*rs));
+    async_timers_init(&timers);
+    atomic_store(&stop, 0);
+
+    for (int i = 0; i < nrt; i++) {
+        struct runner *r = &rs[i];
+        async_rt_init(&r->rt);
+        async_inbox_init(&r->ib, &r->rt, &timers, kick, r);
+        sem_init(&r->kick, 0, 0);
+        r->tasks = calloc(ntasks, sizeof(*r->tasks));
+        r->stacks = calloc(ntasks, STACK_LEN);
+        r->late = malloc(MAX_SAMPLES * sizeof(*r->late));
+        for (int t = 0; t < ntasks; t++) {
+            async_sched(&r->rt, &r->tasks[t], sleeper, r, r->stacks[t], STACK_LEN);
+        }
+        pthread_create(&r->thread, NULL, run_loop, r);
+    }
+
+    // The ticker runs on this thread, on absolute 1 ms deadlines
+    uint64_t ticks = secs * 1000, tick_ns = 0, tick_max = 0;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (uint64_t i = 0; i < ticks; i++) {
+        next.tv_nsec += 1000000;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        uint64_t start = now_ns();
+        ASYNC_TICK(&timers, 1);
+        uint64_t cost = now_ns() - start;
+        tick_ns += cost;
+        tick_max = cost > tick_max ? cost : tick_max;
+    }
+
+    atomic_store(&stop, 1);
+    uint64_t wakeups = 0;
+    uint32_t nlate = 0;
+    for (int i = 0; i < nrt; i++) {
+        sem_post(&rs[i].kick);
+        pthread_join(rs[i].thread, NULL);
+        wakeups += rs[i].wakeups;
+        nlate += rs[i].nlate;
+    }
+
+    uint32_t *late = malloc((size_t)nlate * sizeof(*late));
+    nlate = 0;
+    for (int i = 0; i < nrt; i++) {
+        memcpy(late + nlate, rs[i].late, rs[i].nlate * sizeof(*late));
+        nlate += rs[i].nlate;
+    }
+    qsort(late, nlate, sizeof(*late), cmp_u32);
+
+    printf("%d runtime(s), %6d timers: %8.0f wakeups/s, tick %6.0f ns mean "
+            "%7.0f ns max, late p50 %4u us p99 %5u us\n", nrt, nrt * ntasks,
+            wakeups / secs, (double)tick_ns / ticks, (double)tick_max,
+            nlate ? late[nlate / 2] : 0, nlate ? late[nlate * 99 / 100] : 0);
+
+    free(late);
+    for (int i = 0; i < nrt; i++) {
+        sem_destroy(&rs[i].kick);
+        free(rs[i].tasks);
+        free(rs[i].stacks);
+        free(rs[i].late);
+    }
+    free(rs);
+}
+
+int main(int argc, char **argv)
+{
+    ntasks = argc > 1 ? atoi(argv[1]) : 256;
+    double secs = argc > 2 ? atof(argv[2]) : 1.0;
+
+    for (int nrt = 1; nrt <= 8; nrt *= 2) {
+        run(nrt, secs);
+    }
+    return 0;
+}
@@ -0,0 +1,204 @@
+// @file topic.c
+// Topic fan-out to parked subscribers against subscribers polling a struct
+//
+// Copyright (c) 2024 Tom Wolf
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// Usage: topic [messages] [passes between messages]
+//
+// One publisher sends sensor readings (200000 by default) to 16 subscribers,
+// yielding 8 times between messages.  14 subscribers keep up, 2 spend 40
+// yields on every message and so fall behind the 8 slot ring.  Run once on a
+// topic and once the old way, every subscriber awaiting a sequence counter
+// next to a shared struct.  Subscribers that keep up read in place, slow ones
+// copy each message out before working on it.  Prints resumes per message,
+// messages lost by the slow subscribers, and how many messages arrived corrupt
+// or out of order (must be 0).
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../asyncc_topic.h"
+
+#define SUBS        16
+#define SLOW        2
+#define SLOTS       8
+#define STACK_LEN   96
+
+struct reading {
+    uint32_t seq;
+    int32_t x, y, z;
+    uint32_t check;
+};
+
+static struct async_runtime rt;
+static struct async_task tasks[SUBS + 1];
+static uint8_t stacks[SUBS + 1][STACK_LEN];
+static uint8_t buf[ASYNC_TOPIC_BUF(SLOTS, sizeof(struct reading))] __attribute__((aligned(8)));
+static struct async_topic topic;
+static uint32_t count, gap;
+static volatile int done;
+
+// The old way
+static struct reading shared;
+static uint32_t shared_seq;
+
+static uint32_t received[SUBS], lost[SUBS], bad;
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    fprintf(stderr, "stack overflow: %p needs %d more bytes\n", s, locals_size);
+    exit(1);
+}
+
+static uint32_t checksum(const struct reading *r)
+{
+    return (r->seq * 2654435761u) ^ (uint32_t)r->x ^ ((uint32_t)r->y << 8) ^
+        ((uint32_t)r->z << 16);
+}
+
+static void make(struct reading *r, uint32_t seq)
+{
+    r->seq = seq;
+    r->x = (int32_t)(seq * 7);
+    r->y = -(int32_t)seq;
+    r->z = (int32_t)(seq ^ 0x5A5A);
+    r->check = checksum(r);
+}
+
+static void consume(int id, const struct reading *r, uint32_t expect)
+{
+    bad += r->check != checksum(r) || r->seq != expect;
+    received[id]++;
+}
+
+enum async publisher(uint8_t *s, void *arg)
+{
+    int use_topic = (int)(intptr_t)arg;
+    async_begin(s, uint32_t seq, uint32_t i);
+    for (l->seq = 1; l->seq <= count; l->seq++) {
+        if (use_topic) {
+            make(async_topic_claim(&topic), l->seq);
+            async_topic_publish(&topic, sizeof(struct reading));
+        } else {
+            make(&shared, l->seq);
+            shared_seq = l->seq;
+        }
+        for (l->i = 0; l->i < gap; l->i++) {
+            async_yield;
+        }
+    }
+    done = 1;
+    async_end(s);
+}
+
+enum async subscriber(uint8_t *s, void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    async_begin(s, uint32_t last, uint32_t lost, uint32_t i, struct reading copy);
+    l->last = async_topic_seq(&topic);
+    for (;;) {
+        await_topic(s, &topic, &l->last);
+        const struct reading *r;
+        while ((r = async_topic_next(&topic, &l->last, &l->lost, NULL))) {
+            if (id >= SLOW) {
+                consume(id, r, l->last);        // In place
+                continue;
+            }
+            // Slow ones copy it out first, it may be gone after the yields
+            l->copy = *r;
+            consume(id, &l->copy, l->last);
+            for (l->i = 0; l->i < 40; l->i++) {
+                async_yield;
+            }
+        }
+        lost[id] = l->lost;
+    }
+    async_end(s);
+}
+
+enum async poller(uint8_t *s, void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    async_begin(s, uint32_t last, uint32_t i);
+    l->last = 0;
+    while (!done || l->last != shared_seq) {
+        await(shared_seq != l->last || done);
+        if (shared_seq == l->last) {
+            break;
+        }
+        lost[id] += shared_seq - l->last - 1;
+        l->last = shared_seq;
+        consume(id, &shared, l->last);
+        if (id < SLOW) {
+            for (l->i = 0; l->i < 40; l->i++) {
+                async_yield;
+            }
+        }
+    }
+    async_end(s);
+}
+
+static void run(const char *name, async_task_fn sub, int use_topic)
+{
+    async_rt_init(&rt);
+    async_topic_init(&topic, &rt, buf, SLOTS, sizeof(struct reading));
+    shared_seq = 0;
+    done = 0;
+    for (int i = 0; i < SUBS; i++) {
+        received[i] = lost[i] = 0;
+        async_sched(&rt, &tasks[i], sub, (void*)(intptr_t)i, stacks[i], STACK_LEN);
+    }
+    async_sched(&rt, &tasks[SUBS], publisher, (void*)(intptr_t)use_topic,
+            stacks[SUBS], STACK_LEN);
+
+    struct timespec a, b;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    uint64_t resumes = 0;
+    while (async_next(&rt)) {
+        resumes++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    double ns = (b.tv_sec - a.tv_sec) * 1e9 + (b.tv_nsec - a.tv_nsec);
+
+    uint32_t slow_lost = 0, fast_got = 0;
+    for (int i = 0; i < SUBS; i++) {
+        if (i < SLOW) {
+            slow_lost += lost[i];
+        } else {
+            fast_got += received[i];
+        }
+    }
+    printf("%-7s %6.1f resumes/msg, %6.1f ns/msg, fast subscribers got %5.1f%%, "
+            "slow lost %u of %u\n", name, (double)resumes / count, ns / count,
+            100.0 * fast_got / ((double)count * (SUBS - SLOW)), slow_lost, SLOW * count);
+}
+
+int main(int argc, char **argv)
+{
+    count = argc > 1 ? (uint32_t)atoi(argv[1]) : 200000;
+    gap = argc > 2 ? (uint32_t)atoi(argv[2]) : 8;
+
+    run("topic:", subscriber, 1);
+    run("polled:", poller, 0);
+    printf("%u corrupt or out of order\n", bad);
+    return bad != 0;
+}
@@ -0,0 +1,86 @@
+// @file table.c
+// Tasks known at build time, run from an ASYNC_TASK_TABLE
+//
+// Copyright (c) 2024 Tom Wolf
+// 
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+// 
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+// 
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+// A clock task, a blinker that waits on it, and a reporter that waits for the
+// blinker, scheduled by priority from a compile-time table.  Build with -O2
+// and look at the assembly: nothing calls the task functions, they are all
+// inlined into the unrolled dispatcher (this prints nothing):
+//
+//   cc -O2 -S -o - examples/table.c | grep -E "call.*(tick|blink|report)"
+
+#include <stdint.h>
+#include <stdio.h>
+#include "../asyncc_table.h"
+
+static uint32_t ticks;
+static uint8_t blinks;
+
+void async_err(uint8_t *s, uint16_t locals_size)
+{
+    printf("Error: %p needs %d bytes\n", s, locals_size);
+}
+
+static inline enum async tick(uint8_t *s)
+{
+    async_begin(s);
+    while (ticks < 20) {
+        ticks++;
+        async_yield;
+    }
+    async_end(s);
+}
+
+static inline enum async blink(uint8_t *s)
+{
+    async_begin(s, uint32_t at);
+    for (blinks = 0; blinks < 3; blinks++) {
+        l->at = ticks + 5;
+        await(ticks >= l->at);
+        printf("blink %u at tick %u\n", blinks, ticks);
+    }
+    async_end(s);
+}
+
+static inline enum async report(uint8_t *s)
+{
+    async_begin(s);
+    await(blinks == 3);
+    printf("blinked 3 times by tick %u\n", ticks);
+    async_end(s);
+}
+
+ASYNC_TASK_TABLE(app,
+    (tick,   16, 0),        // (function, stack length, priority)
+    (blink,  16, 1),
+    (report, 16, 2));
+
+int main(void)
+{
+    for (uint8_t i = 0; i < app_tasks_len; i++) {
+        printf("task %u: %u byte stack, priority %u\n", i, app_tasks[i].len,
+                app_tasks[i].prio);
+    }
+    app_init();
+    app_run();
+    return 0;
+}